@@ -1,5 +1,75 @@
+#pragma once
+
 #include <string>
 #include <iostream>
 #include <functional>
+#include <atomic>
+#include <cstdint>
+
+namespace DerperView
+{
+    const int AutoThreads = -1; // A thread for every core for the job, or a share of them picked for the decoder
+    const unsigned int DefaultCheckpointInterval = 60; // seconds, for resuming a job that wasn't checkpointed
+    const size_t DefaultReadAheadSize = 32 * 1024 * 1024; // bytes, a couple of seconds of high bit rate 4K
+
+    // Set from any thread to stop a job. Everything working on it checks as it goes, down to the stretch's row
+    // loop, so it stops within a few milliseconds. A job in one part keeps the frames that reached the muxer by
+    // then, and leaves out what was still in the encoder. A job in segments keeps its finished segments if it's
+    // checkpointing, so it can be resumed, and removes them if not. Either way Go returns AVERROR_EXIT.
+    class CancelToken
+    {
+    public:
+        CancelToken() : cancelled_(false) { }
+
+        void Cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+        void Reset() { cancelled_.store(false, std::memory_order_relaxed); }
+        bool IsCancelled() const { return cancelled_.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<bool> cancelled_;
+    };
+
+    // What the decoder does with threads of its own, when it's given some
+    enum class DecoderThreading
+    {
+        Auto, // frame threads if the codec can do them, otherwise slice threads
+        Frame, // a picture per thread, which adds a frame of delay for each one
+        Slice, // parts of each picture, as far as the stream is cut into slices
+    };
+
+    struct Settings
+    {
+        int threads = AutoThreads; // in all, shared out between the stretch, the encoder and the decoder
+        unsigned int queueDepth = 0; // frames that can wait between decoding and encoding, 0 for twice the thread count
+        unsigned int reorderWindow = 0; // how far a finished frame can get ahead of the one due at the encoder, 0 for the queue depth + 2
+        uint64_t maxMemory = 0; // bytes that frames between decoding and encoding can hold, 0 for no limit
+        size_t ioBufferSize = 0; // bytes buffered in front of the output file, 0 for the default
+        bool noAudio = false; // leave the audio out of the output
+        unsigned int segments = 0; // split the video at keyframes into this many parts to encode at once, 0 or 1 for one part
+        int segmentIndex = -1; // with segments, only encode this part and leave it for JoinSegments, -1 for all of them
+        unsigned int checkpointInterval = 0; // seconds of video between checkpoints a job can be resumed from, 0 for none
+        bool resume = false; // carry on from the checkpoint left by a job that didn't finish, or start one if there isn't
+        int decoderThreads = 1; // threads the video decoder runs of its own out of the total, AutoThreads for a quarter of it, 1 for none
+        DecoderThreading decoderThreading = DecoderThreading::Auto;
+        size_t readAheadSize = DefaultReadAheadSize; // bytes of packets a thread of their own can read ahead of the decoder, 0 to read them as they're wanted
+    };
+
+    // How far a job has got, passed to Go's callback a few times a second from a thread of its own
+    struct ProgressUpdate
+    {
+        int percentage = 0; // of the input's frames encoded, 0 if it isn't known how many there are
+        int64_t framesDecoded = 0;
+        int64_t framesStretched = 0;
+        int64_t framesEncoded = 0;
+        int64_t bytesWritten = 0; // in packets written to the output
+    };
+
+    typedef std::function<void(const ProgressUpdate&)> ProgressCallback;
+}
+
+int Go(const std::string inputFilename, const std::string outputFilename, const DerperView::Settings& settings, std::ostream& outputStream, DerperView::ProgressCallback callback = nullptr, const DerperView::CancelToken& cancel = DerperView::CancelToken());
+int Go(const std::string inputFilename, const std::string outputFilename, const int totalThreads, std::ostream& outputStream, DerperView::ProgressCallback callback = nullptr, const DerperView::CancelToken& cancel = DerperView::CancelToken());
 
-int Go(const std::string inputFilename, const std::string outputFilename, const int totalThreads, std::ostream& outputStream, std::function<void(int)> callback = nullptr, const bool& cancel = false);
+// Joins the parts left by Go runs with settings.segmentIndex set, one for each part, into outputFilename.
+// settings wants the same segments and noAudio the parts were encoded with.
+int JoinSegments(const std::string inputFilename, const std::string outputFilename, const DerperView::Settings& settings, std::ostream& outputStream);
@@ -44,7 +44,7 @@ private:
     ProgressDialog* progressDialog_;
     wxDataViewListCtrl* fileListControl_;
     vector<string> filenameList_;
-    bool cancelThread_;
+    DerperView::CancelToken cancelThread_;
 };
 
 class DerperViewApp : public wxApp
@@ -71,7 +71,7 @@ private:
 };
 
 DerperViewFrame::DerperViewFrame()
-    : wxFrame(nullptr, wxID_ANY, "DerperView"), cancelThread_(false)
+    : wxFrame(nullptr, wxID_ANY, "DerperView")
 {
     wxMenu *menuFile = new wxMenu;
     menuFile->Append(GO_BUTTON_ID, "Go");
@@ -176,7 +176,7 @@ void DerperViewFrame::OnAbout(wxCommandEvent& event)
 
 void DerperViewFrame::OnUpdateFileProgress(wxThreadEvent& ev)
 {
-    progressDialog_->UpdateFileProgress(ev.GetPayload<int>());
+    progressDialog_->UpdateFileProgress(ev.GetPayload<DerperView::ProgressUpdate>());
 }
 
 void DerperViewFrame::OnFileStarted(wxThreadEvent& ev)
@@ -207,7 +207,7 @@ void DerperViewFrame::OnBatchCompleted(wxThreadEvent& ev)
 
 void DerperViewFrame::OnGo(wxCommandEvent& event)
 {
-    cancelThread_ = false;
+    cancelThread_.Reset();
     auto workerThread = new WorkerThread(this, filenameList_, cancelThread_);
     workerThread->Run();
 }
@@ -2,12 +2,13 @@
 
 using namespace std;
 
-ProgressDialog::ProgressDialog(wxWindow* parent, bool& threadCancelled)
+ProgressDialog::ProgressDialog(wxWindow* parent, DerperView::CancelToken& threadCancelled)
     : wxDialog(parent, wxID_ANY, "DerperView - working!", wxDefaultPosition, wxDefaultSize, wxCAPTION | wxSTAY_ON_TOP), threadCancelled_(threadCancelled)
 {
     fileProgress_ = new wxGauge(this, wxID_ANY, 100, wxDefaultPosition, wxSize(100, 20));
     totalProgress_ = new wxGauge(this, wxID_ANY, 1, wxDefaultPosition, wxSize(100, 20));
     currentFile_ = new wxStaticText(this, wxID_ANY, _(""), wxDefaultPosition, wxSize(250, 20), wxALIGN_CENTRE_HORIZONTAL | wxST_NO_AUTORESIZE | wxST_ELLIPSIZE_START);
+    fileCounts_ = new wxStaticText(this, wxID_ANY, _(""), wxDefaultPosition, wxSize(250, 20), wxALIGN_CENTRE_HORIZONTAL | wxST_NO_AUTORESIZE);
 
     cancelButton_ = new wxButton(this, wxID_CANCEL, "Cancel");
     Bind(wxEVT_BUTTON, &ProgressDialog::OnCancel, this, wxID_CANCEL);
@@ -15,19 +16,24 @@ ProgressDialog::ProgressDialog(wxWindow* parent, bool& threadCancelled)
     wxBoxSizer* sizer = new wxBoxSizer(wxVERTICAL);
     sizer->Add(currentFile_, wxSizerFlags().Border(wxALL, 5));
     sizer->Add(fileProgress_, wxSizerFlags().Expand().Border(wxALL, 5));
+    sizer->Add(fileCounts_, wxSizerFlags().Border(wxALL, 5));
     sizer->Add(totalProgress_, wxSizerFlags().Expand().Border(wxALL, 5));
     sizer->Add(cancelButton_, wxSizerFlags().Center().Border(wxALL, 5));
     SetSizerAndFit(sizer);
 }
 
-void ProgressDialog::UpdateFileProgress(int p)
+void ProgressDialog::UpdateFileProgress(const DerperView::ProgressUpdate& p)
 {
-    fileProgress_->SetValue(p);
+    fileProgress_->SetValue(p.percentage);
+    fileCounts_->SetLabelText(wxString::Format("Decoded %lld, stretched %lld, encoded %lld, %lld MB written",
+        static_cast<long long>(p.framesDecoded), static_cast<long long>(p.framesStretched), static_cast<long long>(p.framesEncoded),
+        static_cast<long long>(p.bytesWritten / (1024 * 1024))));
 }
 
 void ProgressDialog::StartFile(string filename)
 {
     fileProgress_->SetValue(0);
+    fileCounts_->SetLabelText("");
     currentFile_->SetLabelText(filename);
 }
 
@@ -49,5 +55,5 @@ void ProgressDialog::CompleteBatch()
 
 void ProgressDialog::OnCancel(wxCommandEvent& ev)
 {
-    threadCancelled_ = true;
+    threadCancelled_.Cancel();
 }
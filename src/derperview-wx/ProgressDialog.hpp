@@ -1,11 +1,12 @@
 #include "derperview-wx.hpp"
+#include "libderperview.hpp"
 
 class ProgressDialog : public wxDialog
 {
 public:
-    ProgressDialog(wxWindow* parent, bool& threadCancelled);
+    ProgressDialog(wxWindow* parent, DerperView::CancelToken& threadCancelled);
 
-    void UpdateFileProgress(int p);
+    void UpdateFileProgress(const DerperView::ProgressUpdate& p);
     void StartFile(std::string filename);
     void CompleteFile();
     void StartBatch(int fileCount);
@@ -14,10 +15,11 @@ public:
 private:
     void OnCancel(wxCommandEvent& ev);
 
-    bool& threadCancelled_;
+    DerperView::CancelToken& threadCancelled_;
 
     wxGauge* totalProgress_;
     wxGauge* fileProgress_;
     wxStaticText* currentFile_;
+    wxStaticText* fileCounts_;
     wxButton* cancelButton_;
 };
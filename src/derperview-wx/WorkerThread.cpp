@@ -22,7 +22,7 @@ wxThreadEvent* CreateThreadEventWithPayload(wxEventType eventType, T payload)
 
 wxThread::ExitCode WorkerThread::Entry()
 {
-    auto callback = [&parent = parent_](int p)
+    auto callback = [&parent = parent_](const DerperView::ProgressUpdate& p)
     {
         wxQueueEvent(parent, CreateThreadEventWithPayload(DERPERVIEW_THREAD_PROGRESS_UPDATE, p));
     };
@@ -30,10 +30,13 @@ wxThread::ExitCode WorkerThread::Entry()
     wxQueueEvent(parent_, CreateThreadEventWithPayload(DERPERVIEW_THREAD_BATCH_STARTED, filenames_.size()));
 
     ostringstream outputStream;
+    DerperView::Settings settings; // Auto threads, sized for whatever this is running on
     for (auto filename : filenames_)
     {
+        if (cancelThread_.IsCancelled())
+            break;
         wxQueueEvent(parent_, CreateThreadEventWithPayload(DERPERVIEW_THREAD_FILE_STARTED, filename));
-        Go(filename, filename + ".out.mp4", 4, outputStream, callback, cancelThread_);
+        Go(filename, filename + ".out.mp4", settings, outputStream, callback, cancelThread_);
         wxQueueEvent(parent_, new wxThreadEvent(DERPERVIEW_THREAD_FILE_COMPLETED));
     }
 
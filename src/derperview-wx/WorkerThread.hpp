@@ -1,4 +1,5 @@
 #include "derperview-wx.hpp"
+#include "libderperview.hpp"
 
 wxDECLARE_EVENT(DERPERVIEW_THREAD_PROGRESS_UPDATE, wxThreadEvent);
 wxDECLARE_EVENT(DERPERVIEW_THREAD_FILE_STARTED, wxThreadEvent);
@@ -9,7 +10,7 @@ wxDECLARE_EVENT(DERPERVIEW_THREAD_BATCH_COMPLETED, wxThreadEvent);
 class WorkerThread : public wxThread
 {
 public:
-    WorkerThread(wxFrame* parent, std::vector<std::string>& filenames, bool& cancelThread)
+    WorkerThread(wxFrame* parent, std::vector<std::string>& filenames, DerperView::CancelToken& cancelThread)
         : wxThread(wxTHREAD_DETACHED), parent_(parent), filenames_(filenames), cancelThread_(cancelThread) { }
 
 protected:
@@ -17,5 +18,5 @@ protected:
 
     wxFrame* parent_;
     std::vector<std::string> filenames_;
-    bool& cancelThread_;
+    DerperView::CancelToken& cancelThread_;
 };
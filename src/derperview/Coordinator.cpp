@@ -0,0 +1,238 @@
+#include "Coordinator.hpp"
+
+#include <thread>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#ifdef _WIN32
+    #define NOMINMAX
+    #include <windows.h>
+#else
+    #include <sys/wait.h>
+#endif
+
+using namespace std;
+
+const int Coordinator::WholeFile;
+const int Coordinator::Join;
+
+// One argument, quoted for the shell popen hands the command line to
+static string QuoteArgument(const string& argument)
+{
+#ifdef _WIN32
+    string quoted = "\"";
+    for (char c : argument)
+    {
+        if (c == '"')
+            quoted += '\\';
+        quoted += c;
+    }
+    return quoted + "\"";
+#else
+    string quoted = "'";
+    for (char c : argument)
+    {
+        if (c == '\'')
+            quoted += "'\\''";
+        else
+            quoted += c;
+    }
+    return quoted + "'";
+#endif
+}
+
+Coordinator::Coordinator(const string& executable, const vector<ManifestJob>& jobs, unsigned int workers, int threadsPerWorker, ostream& outputStream) :
+    executable_(executable), jobs_(jobs), workers_(max(1u, workers)), threadsPerWorker_(threadsPerWorker), outputStream_(outputStream),
+    unfinishedJobs_(jobs.size()), states_(jobs.size())
+{
+}
+
+int Coordinator::Run()
+{
+    // Every part of a split file can go straight away, its join has to wait for them
+    for (size_t i = 0; i < jobs_.size(); i++)
+    {
+        if (jobs_[i].segments > 1)
+        {
+            states_[i].partsLeft = jobs_[i].segments;
+            for (unsigned int segment = 0; segment < jobs_[i].segments; segment++)
+                tasks_.push_back({ i, static_cast<int>(segment) });
+        }
+        else
+            tasks_.push_back({ i, WholeFile });
+    }
+
+    outputStream_ << "Running " << jobs_.size() << " jobs (" << tasks_.size() << " tasks) on " << workers_ << " workers" << endl;
+
+    vector<thread> workers;
+    for (unsigned int i = 0; i < workers_; i++)
+        workers.emplace_back(&Coordinator::WorkerEntry, this);
+    for (auto& worker : workers)
+        worker.join();
+
+    outputStream_ << "--------------------------------------------------------------------" << endl;
+    int failed = 0;
+    for (size_t i = 0; i < jobs_.size(); i++)
+    {
+        const JobState& state = states_[i];
+        outputStream_ << jobs_[i].input << ": " << (state.status == 0 ? "done" : "failed with " + to_string(state.status))
+            << ", " << state.frames << " frames in " << static_cast<int64_t>(state.seconds) << "s";
+        if (state.seconds > 0)
+            outputStream_ << " (" << static_cast<int64_t>(state.frames / state.seconds) << " fps)";
+        outputStream_ << endl;
+        if (state.status != 0)
+            failed++;
+    }
+    outputStream_ << "--------------------------------------------------------------------" << endl;
+    return failed;
+}
+
+void Coordinator::WorkerEntry()
+{
+    unique_lock<mutex> lock(mutex_);
+    while (true)
+    {
+        // A join can turn up while the other workers are still going, so wait for everything to be finished
+        // rather than for the queue to be empty
+        changed_.wait(lock, [this] { return !tasks_.empty() || unfinishedJobs_ == 0; });
+        if (tasks_.empty())
+            return;
+
+        Task task = tasks_.front();
+        tasks_.pop_front();
+        JobState& state = states_[task.job];
+        if (!state.startedYet)
+        {
+            state.startedYet = true;
+            state.started = chrono::steady_clock::now();
+        }
+        const ManifestJob& job = jobs_[task.job];
+        outputStream_ << "Starting " << job.input;
+        if (task.segment == Join)
+            outputStream_ << ", joining its " << job.segments << " parts";
+        else if (task.segment != WholeFile)
+            outputStream_ << ", part " << task.segment + 1 << " of " << job.segments;
+        outputStream_ << endl;
+        lock.unlock();
+
+        int64_t frames = 0;
+        string tail;
+        int status = RunProcess(GetArguments(task), frames, tail);
+
+        lock.lock();
+        Finish(task, status, frames, tail);
+    }
+}
+
+void Coordinator::Finish(const Task& task, int status, int64_t frames, const string& tail)
+{
+    JobState& state = states_[task.job];
+    state.frames += frames;
+    if (status != 0)
+    {
+        outputStream_ << "*** " << jobs_[task.job].input << " failed with " << status << ", last said:" << endl << tail;
+        if (state.status == 0)
+            state.status = status;
+    }
+
+    bool jobDone = true;
+    if (task.segment >= 0)
+    {
+        // The join goes once the last part is in, unless one of them didn't make it
+        jobDone = --state.partsLeft == 0 && state.status != 0;
+        if (state.partsLeft == 0 && state.status == 0)
+            tasks_.push_back({ task.job, Join });
+    }
+
+    if (jobDone)
+    {
+        state.seconds = chrono::duration<double>(chrono::steady_clock::now() - state.started).count();
+        unfinishedJobs_--;
+    }
+    changed_.notify_all();
+}
+
+vector<string> Coordinator::GetArguments(const Task& task) const
+{
+    const ManifestJob& job = jobs_[task.job];
+    vector<string> arguments = { executable_, "--worker", "--output", job.output };
+    if (job.noAudio)
+        arguments.push_back("--no-audio");
+    if (task.segment != WholeFile)
+    {
+        arguments.push_back("--segments");
+        arguments.push_back(to_string(job.segments));
+    }
+    if (task.segment == Join)
+        arguments.push_back("--join");
+    else
+    {
+        if (task.segment != WholeFile)
+        {
+            arguments.push_back("--segment-index");
+            arguments.push_back(to_string(task.segment));
+        }
+        arguments.push_back("--threads");
+        arguments.push_back(threadsPerWorker_ > 0 ? to_string(threadsPerWorker_) : "auto");
+    }
+    arguments.push_back(job.input);
+    return arguments;
+}
+
+int Coordinator::RunProcess(const vector<string>& arguments, int64_t& frames, string& tail)
+{
+    string commandLine;
+    for (auto& argument : arguments)
+        commandLine += (commandLine.empty() ? "" : " ") + QuoteArgument(argument);
+    commandLine += " 2>&1";
+
+#ifdef _WIN32
+    // cmd /c strips the outer quotes off, and wants the command line in UTF-16 to get filenames through intact
+    commandLine = "\"" + commandLine + "\"";
+    wstring wideCommandLine(MultiByteToWideChar(CP_UTF8, 0, commandLine.c_str(), -1, nullptr, 0), L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, commandLine.c_str(), -1, &wideCommandLine[0], static_cast<int>(wideCommandLine.size()));
+    FILE *pipe = _wpopen(wideCommandLine.c_str(), L"r");
+#else
+    FILE *pipe = popen(commandLine.c_str(), "r");
+#endif
+    if (pipe == nullptr)
+    {
+        tail = "could not start " + commandLine + "\n";
+        return -1;
+    }
+
+    const size_t TailLines = 10;
+    deque<string> lines;
+    string line;
+    char buffer[4096];
+    while (fgets(buffer, sizeof(buffer), pipe) != nullptr)
+    {
+        line += buffer;
+        if (line.back() != '\n')
+            continue;
+
+        const char *framesRead = "Frames read: ";
+        if (line.compare(0, strlen(framesRead), framesRead) == 0)
+            frames += strtoll(line.c_str() + strlen(framesRead), nullptr, 10);
+        lines.push_back(line);
+        if (lines.size() > TailLines)
+            lines.pop_front();
+        line.clear();
+    }
+    if (!line.empty())
+        lines.push_back(line + "\n");
+    for (auto& kept : lines)
+        tail += kept;
+
+#ifdef _WIN32
+    return _pclose(pipe);
+#else
+    int status = pclose(pipe);
+    if (status == -1)
+        return -1;
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status); // the same as a shell would report it
+    return WEXITSTATUS(status);
+#endif
+}
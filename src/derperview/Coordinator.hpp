@@ -0,0 +1,66 @@
+#pragma once
+
+#include "Manifest.hpp"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+
+// Works through the jobs in a manifest with worker processes, each of them this program run with --worker on
+// a single file or one part of one. A crash in libav only takes out the job it happened in, and the workers
+// don't share an allocator or anything else. A file split into parts has them encoded by as many workers as
+// are free, then joined by one more once they're all done.
+class Coordinator
+{
+public:
+    // threadsPerWorker is passed on as --threads, each worker's total to share out, 0 to leave each one on auto
+    Coordinator(const std::string& executable, const std::vector<ManifestJob>& jobs, unsigned int workers, int threadsPerWorker, std::ostream& outputStream);
+
+    // Returns once every job has finished one way or another, with the number that failed
+    int Run();
+
+protected:
+    static const int WholeFile = -1;
+    static const int Join = -2;
+
+    struct Task
+    {
+        size_t job;
+        int segment; // the part to encode, or WholeFile or Join
+    };
+
+    struct JobState
+    {
+        unsigned int partsLeft = 0;
+        int status = 0; // the first non-zero exit code from any of its workers
+        int64_t frames = 0;
+        std::chrono::steady_clock::time_point started;
+        double seconds = 0;
+        bool startedYet = false;
+    };
+
+    void WorkerEntry();
+    void Finish(const Task& task, int status, int64_t frames, const std::string& tail);
+    std::vector<std::string> GetArguments(const Task& task) const;
+
+    // Runs the command and waits for it, returning its exit code. Counts the frames it reports reading along
+    // the way, and keeps the last few lines of what it said in case it fails.
+    int RunProcess(const std::vector<std::string>& arguments, int64_t& frames, std::string& tail);
+
+    std::string executable_;
+    std::vector<ManifestJob> jobs_;
+    unsigned int workers_;
+    int threadsPerWorker_;
+    std::ostream& outputStream_;
+
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<Task> tasks_;
+    size_t unfinishedJobs_;
+    std::vector<JobState> states_;
+};
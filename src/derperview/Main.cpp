@@ -10,19 +10,54 @@ extern "C"
 #include <cmath>
 #include <thread>
 #include <algorithm>
+#include <csignal>
 #include "libderperview.hpp"
 #include "version.hpp"
 #include "cxxopts.hpp"
+#include "Coordinator.hpp"
 
 using namespace std;
 
 cxxopts::Options options("derperview", "creates derperview (like superview) from 4:3 videos");
 
+// Ctrl+C stops the job the same way the GUI's cancel button does, CancelToken says what's left of it after
+DerperView::CancelToken cancel;
+
+void OnInterrupt(int)
+{
+    cancel.Cancel();
+}
+
 void SuppressLibAvOutput(void* careface, int whatevs, const char* pfff, va_list sigh)
 {
     // STFU
 }
 
+// Takes a number of bytes, optionally followed by K, M or G
+bool ParseByteSize(const string& text, uint64_t& bytes)
+{
+    size_t end = 0;
+    try
+    {
+        bytes = stoull(text, &end);
+    }
+    catch (const exception&)
+    {
+        return false;
+    }
+
+    string suffix = text.substr(end);
+    if (suffix == "K" || suffix == "k")
+        bytes *= 1024;
+    else if (suffix == "M" || suffix == "m")
+        bytes *= 1024 * 1024;
+    else if (suffix == "G" || suffix == "g")
+        bytes *= 1024 * 1024 * 1024;
+    else if (!suffix.empty())
+        return false;
+    return true;
+}
+
 int main(int argc, char** argv)
 {
     cout << "derperview " << VERSION << endl << endl;
@@ -31,7 +66,23 @@ int main(int argc, char** argv)
         ("i,input", "Input filename", cxxopts::value<std::string>())
         ("o,output", "Output filename (default: INPUT_FILE + .out.mp4)", cxxopts::value<std::string>())
         ("q,stfu", "Suppress libav output", cxxopts::value<bool>()->default_value("false"))
-        ("t,threads", "Process using given number of threads (default: 4)", cxxopts::value<unsigned int>())
+        ("t,threads", "Threads in all, shared out between stretching, encoding and decoding, or auto for one per core (default: auto)", cxxopts::value<std::string>())
+        ("decoder-threads", "Threads the decoder runs of its own out of --threads, or auto for a quarter of them (default: 1, none of its own)", cxxopts::value<std::string>())
+        ("decoder-threading", "What the decoder uses its threads for: frame, slice or auto (default: auto)", cxxopts::value<std::string>())
+        ("queue-depth", "Frames that can be waiting between decoding and encoding (default: twice the number of stretch threads)", cxxopts::value<unsigned int>())
+        ("reorder-window", "How many frames a finished frame can get ahead of the next one due at the encoder (default: queue depth + 2)", cxxopts::value<unsigned int>())
+        ("max-memory", "Most memory frames on their way through can use, e.g. 2G or 512M (default: no limit)", cxxopts::value<std::string>())
+        ("io-buffer", "Size of the buffer in front of the output file, e.g. 16M (default: 4M)", cxxopts::value<std::string>())
+        ("read-ahead", "Most of the input file that can be read ahead of the decoder, e.g. 64M, or 0 to read as it decodes (default: 32M)", cxxopts::value<std::string>())
+        ("no-audio", "Leave the audio out of the output", cxxopts::value<bool>()->default_value("false"))
+        ("segments", "Split the video into this many parts at keyframes and encode them all at once (default: 1)", cxxopts::value<unsigned int>())
+        ("checkpoint", "Encode in parts of this many seconds, keeping track of them so the job can be resumed if it's stopped", cxxopts::value<unsigned int>())
+        ("resume", "Carry on from where a job run with --checkpoint was stopped", cxxopts::value<bool>()->default_value("false"))
+        ("manifest", "Process the jobs listed in a JSON file with separate worker processes, instead of a single input", cxxopts::value<std::string>())
+        ("workers", "Number of worker processes for --manifest (default: 2)", cxxopts::value<unsigned int>())
+        ("worker", "Run as one of --manifest's workers", cxxopts::value<bool>()->default_value("false"))
+        ("segment-index", "With --segments, only encode this part and leave it for --join", cxxopts::value<int>())
+        ("join", "With --segments, join the parts left by --segment-index runs", cxxopts::value<bool>()->default_value("false"))
         ("h,help", "Print help")
         ;
 
@@ -39,6 +90,40 @@ int main(int argc, char** argv)
     options.positional_help("INPUT_FILE");
     auto args = options.parse(argc, argv);
 
+    if (args.count("manifest"))
+    {
+        vector<ManifestJob> jobs;
+        string error;
+        if (!ReadManifest(args["manifest"].as<string>(), jobs, error))
+        {
+            cerr << "could not read manifest: " << error << endl;
+            exit(1);
+        }
+
+        // Workers share the machine, so unless told otherwise each gets its share of the threads, which it splits
+        // up the same way as auto would
+        unsigned int workers = args.count("workers") ? args["workers"].as<unsigned int>() : 2;
+        int threadsPerWorker = static_cast<int>(max(1u, thread::hardware_concurrency() / max(1u, workers)));
+        if (args.count("threads") && args["threads"].as<string>() != "auto")
+        {
+            try
+            {
+                threadsPerWorker = stoi(args["threads"].as<string>());
+            }
+            catch (const exception&)
+            {
+                threadsPerWorker = 0;
+            }
+            if (threadsPerWorker < 1)
+            {
+                cerr << "number of threads must be a number or auto" << endl;
+                exit(1);
+            }
+        }
+        Coordinator coordinator(argv[0], jobs, workers, threadsPerWorker, cout);
+        return coordinator.Run() == 0 ? 0 : 1;
+    }
+
     if (args.count("help") || !args.count("input"))
     {
         cout << options.help() << endl;
@@ -47,7 +132,7 @@ int main(int argc, char** argv)
 
     string inputFilename;
     string outputFilename;
-    unsigned int totalThreads = 4;
+    DerperView::Settings settings;
 
     if (args.count("input"))
     {
@@ -71,15 +156,139 @@ int main(int argc, char** argv)
         cout << "using output filename: " << outputFilename << " (derived from input filename)" << endl;
     }
 
-    if (args.count("threads"))
+    if (args.count("threads") && args["threads"].as<string>() != "auto")
     {
-        totalThreads = args["threads"].as<unsigned int>();
-        cout << "number of threads: " << totalThreads << " (from command line)" << endl;
+        try
+        {
+            settings.threads = stoi(args["threads"].as<string>());
+        }
+        catch (const exception&)
+        {
+            settings.threads = 0;
+        }
+        if (settings.threads < 1)
+        {
+            cerr << "number of threads must be a number or auto" << endl;
+            exit(1);
+        }
+        cout << "number of threads: " << settings.threads << " (from command line)" << endl;
     }
     else
-        cout << "number of threads: " << totalThreads << " (default value)" << endl;
+        cout << "number of threads: auto" << endl;
 
-    if (args.count("stfu") && args["stfu"].as<bool>() == true)
+    if (args.count("decoder-threads"))
+    {
+        if (args["decoder-threads"].as<string>() == "auto")
+            settings.decoderThreads = DerperView::AutoThreads;
+        else
+        {
+            try
+            {
+                settings.decoderThreads = stoi(args["decoder-threads"].as<string>());
+            }
+            catch (const exception&)
+            {
+                cerr << "number of decoder threads must be a number or auto" << endl;
+                exit(1);
+            }
+        }
+        cout << "decoder threads: " << args["decoder-threads"].as<string>() << " (from command line)" << endl;
+    }
+
+    if (args.count("decoder-threading"))
+    {
+        string threading = args["decoder-threading"].as<string>();
+        if (threading == "frame")
+            settings.decoderThreading = DerperView::DecoderThreading::Frame;
+        else if (threading == "slice")
+            settings.decoderThreading = DerperView::DecoderThreading::Slice;
+        else if (threading != "auto")
+        {
+            cerr << "decoder threading must be frame, slice or auto" << endl;
+            exit(1);
+        }
+        cout << "decoder threading: " << threading << " (from command line)" << endl;
+    }
+
+    if (args.count("queue-depth"))
+    {
+        settings.queueDepth = args["queue-depth"].as<unsigned int>();
+        cout << "queue depth: " << settings.queueDepth << " (from command line)" << endl;
+    }
+
+    if (args.count("reorder-window"))
+    {
+        settings.reorderWindow = args["reorder-window"].as<unsigned int>();
+        cout << "reorder window: " << settings.reorderWindow << " (from command line)" << endl;
+    }
+
+    if (args.count("max-memory"))
+    {
+        if (!ParseByteSize(args["max-memory"].as<string>(), settings.maxMemory))
+        {
+            cerr << "max memory must be a number of bytes, optionally followed by K, M or G" << endl;
+            exit(1);
+        }
+        cout << "max memory: " << settings.maxMemory << " bytes (from command line)" << endl;
+    }
+
+    if (args.count("io-buffer"))
+    {
+        uint64_t ioBufferSize = 0;
+        if (!ParseByteSize(args["io-buffer"].as<string>(), ioBufferSize) || ioBufferSize == 0 || ioBufferSize > INT32_MAX)
+        {
+            cerr << "io buffer must be a number of bytes under 2G, optionally followed by K, M or G" << endl;
+            exit(1);
+        }
+        settings.ioBufferSize = static_cast<size_t>(ioBufferSize);
+        cout << "io buffer: " << settings.ioBufferSize << " bytes (from command line)" << endl;
+    }
+
+    if (args.count("read-ahead"))
+    {
+        uint64_t readAheadSize = 0;
+        if (!ParseByteSize(args["read-ahead"].as<string>(), readAheadSize))
+        {
+            cerr << "read ahead must be a number of bytes, optionally followed by K, M or G" << endl;
+            exit(1);
+        }
+        settings.readAheadSize = static_cast<size_t>(readAheadSize);
+        cout << "read ahead: " << settings.readAheadSize << " bytes (from command line)" << endl;
+    }
+
+    if (args.count("no-audio") && args["no-audio"].as<bool>() == true)
+    {
+        settings.noAudio = true;
+        cout << "leaving out audio" << endl;
+    }
+
+    if (args.count("segments"))
+    {
+        settings.segments = args["segments"].as<unsigned int>();
+        cout << "segments: " << settings.segments << " (from command line)" << endl;
+    }
+
+    if (args.count("checkpoint"))
+    {
+        settings.checkpointInterval = args["checkpoint"].as<unsigned int>();
+        cout << "checkpoint every " << settings.checkpointInterval << " seconds (from command line)" << endl;
+    }
+
+    if (args.count("resume") && args["resume"].as<bool>() == true)
+    {
+        settings.resume = true;
+        cout << "resuming" << endl;
+    }
+
+    if (args.count("segment-index"))
+    {
+        settings.segmentIndex = args["segment-index"].as<int>();
+        cout << "segment index: " << settings.segmentIndex << " (from command line)" << endl;
+    }
+
+    // A worker's output goes back to the coordinator, which only wants to hear from us
+    bool worker = args.count("worker") && args["worker"].as<bool>() == true;
+    if (worker || (args.count("stfu") && args["stfu"].as<bool>() == true))
     {
         av_log_set_callback(&SuppressLibAvOutput);
         cout << "setting shut up mode" << endl;
@@ -88,12 +297,20 @@ int main(int argc, char** argv)
     chrono::system_clock clock;
     auto startTime = clock.now();
 
-    int result = Go(inputFilename, outputFilename, totalThreads, cout);
+    signal(SIGINT, &OnInterrupt);
+    int result = 0;
+    if (args.count("join") && args["join"].as<bool>() == true)
+        result = JoinSegments(inputFilename, outputFilename, settings, cout);
+    else
+        result = Go(inputFilename, outputFilename, settings, cout, nullptr, cancel);
 
     auto endTime = clock.now();
     auto minutes = chrono::duration_cast<chrono::minutes>(endTime - startTime).count();
     auto seconds = chrono::duration_cast<chrono::seconds>(endTime - startTime).count() % 60;
     cout << "Total time: " << minutes << "m " << seconds << "s" << endl;
 
+    // Exit codes only go up to 255, and libav's errors are big negative numbers that could come out as 0
+    if (worker)
+        return result == 0 ? 0 : 1;
     return result;
 }
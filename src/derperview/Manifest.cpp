@@ -0,0 +1,267 @@
+#include "Manifest.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <cstdint>
+#include <cstdlib>
+
+using namespace std;
+
+// Just enough JSON for a manifest: a value is a string, a number, true/false/null, an array or an object
+struct JsonValue
+{
+    enum class Type { Null, Bool, Number, String, Array, Object };
+
+    Type type = Type::Null;
+    bool boolean = false;
+    double number = 0;
+    string text;
+    vector<JsonValue> items;
+    map<string, JsonValue> members;
+};
+
+class JsonParser
+{
+public:
+    JsonParser(const string& text) : text_(text), position_(0) { }
+
+    bool Parse(JsonValue& value, string& error)
+    {
+        if (!ParseValue(value) || (SkipSpace(), position_ != text_.size()))
+        {
+            error = error_.empty() ? "unexpected text" : error_;
+            error += " at offset " + to_string(position_);
+            return false;
+        }
+        return true;
+    }
+
+protected:
+    void SkipSpace()
+    {
+        while (position_ < text_.size() && (text_[position_] == ' ' || text_[position_] == '\t' || text_[position_] == '\r' || text_[position_] == '\n'))
+            position_++;
+    }
+
+    bool Expect(char c)
+    {
+        SkipSpace();
+        if (position_ < text_.size() && text_[position_] == c)
+        {
+            position_++;
+            return true;
+        }
+        error_ = string("expected '") + c + "'";
+        return false;
+    }
+
+    bool ParseLiteral(const char *literal)
+    {
+        string word(literal);
+        if (text_.compare(position_, word.size(), word) != 0)
+            return false;
+        position_ += word.size();
+        return true;
+    }
+
+    bool ParseValue(JsonValue& value)
+    {
+        SkipSpace();
+        if (position_ >= text_.size())
+        {
+            error_ = "unexpected end";
+            return false;
+        }
+
+        char c = text_[position_];
+        if (c == '{')
+            return ParseObject(value);
+        if (c == '[')
+            return ParseArray(value);
+        if (c == '"')
+        {
+            value.type = JsonValue::Type::String;
+            return ParseString(value.text);
+        }
+        if (ParseLiteral("true") || ParseLiteral("false"))
+        {
+            value.type = JsonValue::Type::Bool;
+            value.boolean = c == 't';
+            return true;
+        }
+        if (ParseLiteral("null"))
+            return true;
+
+        const char *start = text_.c_str() + position_;
+        char *end = nullptr;
+        value.number = strtod(start, &end);
+        if (end == start)
+        {
+            error_ = "expected a value";
+            return false;
+        }
+        value.type = JsonValue::Type::Number;
+        position_ += end - start;
+        return true;
+    }
+
+    bool ParseString(string& result)
+    {
+        position_++; // the opening quote
+        while (position_ < text_.size() && text_[position_] != '"')
+        {
+            char c = text_[position_++];
+            if (c != '\\')
+            {
+                result += c;
+                continue;
+            }
+            if (position_ >= text_.size())
+                break;
+
+            c = text_[position_++];
+            switch (c)
+            {
+            case 'b': result += '\b'; break;
+            case 'f': result += '\f'; break;
+            case 'n': result += '\n'; break;
+            case 'r': result += '\r'; break;
+            case 't': result += '\t'; break;
+            case 'u':
+            {
+                // Outside of the BMP would need surrogate pairs, which no filename is going to need
+                if (position_ + 4 > text_.size())
+                    break;
+                uint32_t code = static_cast<uint32_t>(strtoul(text_.substr(position_, 4).c_str(), nullptr, 16));
+                position_ += 4;
+                if (code < 0x80)
+                    result += static_cast<char>(code);
+                else if (code < 0x800)
+                {
+                    result += static_cast<char>(0xc0 | (code >> 6));
+                    result += static_cast<char>(0x80 | (code & 0x3f));
+                }
+                else
+                {
+                    result += static_cast<char>(0xe0 | (code >> 12));
+                    result += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+                    result += static_cast<char>(0x80 | (code & 0x3f));
+                }
+                break;
+            }
+            default: result += c; break; // \" \\ and \/
+            }
+        }
+        if (position_ >= text_.size())
+        {
+            error_ = "unterminated string";
+            return false;
+        }
+        position_++; // the closing quote
+        return true;
+    }
+
+    bool ParseArray(JsonValue& value)
+    {
+        value.type = JsonValue::Type::Array;
+        position_++;
+        SkipSpace();
+        if (position_ < text_.size() && text_[position_] == ']')
+        {
+            position_++;
+            return true;
+        }
+        do
+        {
+            value.items.emplace_back();
+            if (!ParseValue(value.items.back()))
+                return false;
+            SkipSpace();
+        } while (position_ < text_.size() && text_[position_] == ',' && ++position_);
+        return Expect(']');
+    }
+
+    bool ParseObject(JsonValue& value)
+    {
+        value.type = JsonValue::Type::Object;
+        position_++;
+        SkipSpace();
+        if (position_ < text_.size() && text_[position_] == '}')
+        {
+            position_++;
+            return true;
+        }
+        do
+        {
+            SkipSpace();
+            string name;
+            if (position_ >= text_.size() || text_[position_] != '"')
+            {
+                error_ = "expected a name";
+                return false;
+            }
+            if (!ParseString(name) || !Expect(':') || !ParseValue(value.members[name]))
+                return false;
+            SkipSpace();
+        } while (position_ < text_.size() && text_[position_] == ',' && ++position_);
+        return Expect('}');
+    }
+
+    const string& text_;
+    size_t position_;
+    string error_;
+};
+
+bool ReadManifest(const string& filename, vector<ManifestJob>& jobs, string& error)
+{
+    ifstream file(filename, ios::binary);
+    if (!file)
+    {
+        error = "can't open " + filename;
+        return false;
+    }
+    stringstream contents;
+    contents << file.rdbuf();
+    string text = contents.str();
+
+    JsonValue root;
+    JsonParser parser(text);
+    if (!parser.Parse(root, error))
+        return false;
+
+    const JsonValue *list = &root;
+    if (root.type == JsonValue::Type::Object && root.members.count("jobs"))
+        list = &root.members.at("jobs");
+    if (list->type != JsonValue::Type::Array)
+    {
+        error = "expected a list of jobs";
+        return false;
+    }
+
+    for (size_t i = 0; i < list->items.size(); i++)
+    {
+        const JsonValue& item = list->items[i];
+        auto input = item.members.find("input");
+        if (item.type != JsonValue::Type::Object || input == item.members.end() || input->second.type != JsonValue::Type::String)
+        {
+            error = "job " + to_string(i) + " has no input";
+            return false;
+        }
+
+        ManifestJob job;
+        job.input = input->second.text;
+        job.output = job.input + ".out.mp4";
+        auto output = item.members.find("output");
+        if (output != item.members.end() && output->second.type == JsonValue::Type::String)
+            job.output = output->second.text;
+        auto segments = item.members.find("segments");
+        if (segments != item.members.end() && segments->second.type == JsonValue::Type::Number && segments->second.number >= 1)
+            job.segments = static_cast<unsigned int>(segments->second.number);
+        auto noAudio = item.members.find("noAudio");
+        if (noAudio != item.members.end() && noAudio->second.type == JsonValue::Type::Bool)
+            job.noAudio = noAudio->second.boolean;
+        jobs.push_back(job);
+    }
+    return true;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// One file to process, as listed in a manifest
+struct ManifestJob
+{
+    std::string input;
+    std::string output; // INPUT + .out.mp4 if the manifest doesn't say
+    unsigned int segments = 1; // more than 1 to spread the file across workers in keyframe-aligned parts
+    bool noAudio = false;
+};
+
+// Reads a manifest of the form
+//
+//     { "jobs": [ { "input": "a.mp4", "output": "a-derped.mp4", "segments": 4 }, { "input": "b.mp4" } ] }
+//
+// or just the array on its own. Only input is needed, noAudio can be given too. Returns false with error
+// filled in if the file can't be read or isn't in that form.
+bool ReadManifest(const std::string& filename, std::vector<ManifestJob>& jobs, std::string& error);
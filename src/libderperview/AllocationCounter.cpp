@@ -0,0 +1,81 @@
+#include "AllocationCounter.hpp"
+
+#include <new>
+#include <cstdlib>
+
+using namespace DerperView;
+
+std::atomic<uint64_t> AllocationCounter::allocations_(0);
+std::atomic<uint64_t> AllocationCounter::bytes_(0);
+
+// Every C++ allocation in the process comes through these rather than the standard library's, so none of them
+// can be missed. Being in the library, they go in any program linked with it.
+void *operator new(std::size_t size)
+{
+    AllocationCounter::Record(size);
+    if (size == 0)
+        size = 1;
+    while (true)
+    {
+        void *memory = std::malloc(size);
+        if (memory != nullptr)
+            return memory;
+
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+void *operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    try
+    {
+        return operator new(size);
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return operator new(size, std::nothrow);
+}
+
+void operator delete(void *memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void *memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void *memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void *memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void *memory, const std::nothrow_t&) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void *memory, const std::nothrow_t&) noexcept
+{
+    std::free(memory);
+}
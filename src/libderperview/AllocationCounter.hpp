@@ -0,0 +1,42 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+namespace DerperView
+{
+    struct AllocationCounts
+    {
+        uint64_t allocations;
+        uint64_t bytes;
+    };
+
+    // Tally of the allocations the process makes. Every C++ one is counted by the global operator new, which
+    // AllocationCounter.cpp replaces. libav allocates with av_malloc, which C++ can't see, so the frames, packets
+    // and buffers we ask it for are Recorded where we ask. What it allocates inside the decoders, encoders and
+    // muxer (x264's lookahead, the muxer's interleaving queue, side data on packets) isn't counted at all. Once
+    // a job has warmed up this should stop moving, and anything that shows up here per frame is a regression.
+    // It's the whole process, so in the GUI whatever wxWidgets allocates meanwhile is in it too.
+    class AllocationCounter
+    {
+    public:
+        static void Record(size_t bytes)
+        {
+            allocations_.fetch_add(1, std::memory_order_relaxed);
+            bytes_.fetch_add(bytes, std::memory_order_relaxed);
+        }
+
+        static AllocationCounts Get()
+        {
+            AllocationCounts counts;
+            counts.allocations = allocations_;
+            counts.bytes = bytes_;
+            return counts;
+        }
+
+    protected:
+        static std::atomic<uint64_t> allocations_;
+        static std::atomic<uint64_t> bytes_;
+    };
+}
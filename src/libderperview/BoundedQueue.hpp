@@ -0,0 +1,99 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <mutex>
+#include <condition_variable>
+
+namespace DerperView
+{
+    // Queue between two pipeline stages. Push waits while it's full, which is what keeps a fast stage from
+    // running away from a slow one. Items sit in a fixed ring, so nothing is allocated as they pass through.
+    template <typename T>
+    class BoundedQueue
+    {
+    public:
+        BoundedQueue(size_t capacity) : items_(std::max<size_t>(1, capacity)), head_(0), count_(0), highWater_(0), closed_(false) { }
+
+        // Waits for room, and returns false without queueing the item if the queue has been closed
+        bool Push(T item)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            notFull_.wait(lock, [this] { return closed_ || count_ < items_.size(); });
+            if (closed_)
+                return false;
+            items_[(head_ + count_) % items_.size()] = std::move(item);
+            count_++;
+            highWater_ = std::max(highWater_, count_);
+            lock.unlock();
+            notEmpty_.notify_one();
+            return true;
+        }
+
+        // Waits for an item, and returns false once the queue has been closed and everything in it taken
+        bool Pop(T& item)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            notEmpty_.wait(lock, [this] { return closed_ || count_ > 0; });
+            if (count_ == 0)
+                return false;
+            item = std::move(items_[head_]);
+            head_ = (head_ + 1) % items_.size();
+            count_--;
+            lock.unlock();
+            notFull_.notify_one();
+            return true;
+        }
+
+        // Pop, but returns false straight away rather than wait for an item
+        bool TryPop(T& item)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (count_ == 0)
+                return false;
+            item = std::move(items_[head_]);
+            head_ = (head_ + 1) % items_.size();
+            count_--;
+            lock.unlock();
+            notFull_.notify_one();
+            return true;
+        }
+
+        // No more pushes. Whatever is already queued can still be popped.
+        void Close()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                closed_ = true;
+            }
+            notFull_.notify_all();
+            notEmpty_.notify_all();
+        }
+
+        size_t GetSize() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return count_;
+        }
+
+        size_t GetCapacity() const { return items_.size(); }
+
+        // Most items that have been in the queue at once
+        size_t GetHighWater() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return highWater_;
+        }
+
+    protected:
+        std::vector<T> items_;
+        size_t head_;
+        size_t count_;
+        size_t highWater_;
+        bool closed_;
+        mutable std::mutex mutex_;
+        std::condition_variable notFull_;
+        std::condition_variable notEmpty_;
+    };
+}
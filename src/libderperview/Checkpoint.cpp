@@ -0,0 +1,103 @@
+#include "Checkpoint.hpp"
+#include "Progress.hpp"
+
+extern "C"
+{
+    #include "libavutil/error.h"
+}
+
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cerrno>
+
+using namespace DerperView;
+using namespace std;
+
+// First line of the file, followed by the number of segments. Then there's a line for each finished segment.
+static const char *CheckpointHeader = "derperview-checkpoint 1";
+
+Checkpoint::Checkpoint(string outputFilename, ostream& outputStream) :
+    filename_(outputFilename + ".checkpoint"), outputStream_(outputStream), segmentCount_(0)
+{
+}
+
+bool Checkpoint::Load()
+{
+    ifstream file(filename_);
+    string line;
+    if (!getline(file, line) || line.compare(0, string(CheckpointHeader).size(), CheckpointHeader) != 0)
+        return false;
+    istringstream(line.substr(string(CheckpointHeader).size())) >> segmentCount_;
+    if (segmentCount_ == 0)
+        return false;
+
+    // A line that was only half written when the job died is left out, along with anything after it
+    entries_.clear();
+    while (getline(file, line))
+    {
+        CheckpointEntry entry;
+        istringstream fields(line);
+        if (!(fields >> entry.index >> entry.start >> entry.end >> entry.frameCount >> entry.bytes) || entry.index >= segmentCount_)
+            break;
+        entries_.push_back(entry);
+    }
+    return true;
+}
+
+int Checkpoint::Start(unsigned int segmentCount, const vector<CheckpointEntry>& keep)
+{
+    lock_guard<mutex> lock(mutex_);
+    vector<CheckpointEntry> kept = keep; // it could be our own entries
+    segmentCount_ = segmentCount;
+    entries_.clear();
+
+    ofstream file(filename_, ios::trunc);
+    file << CheckpointHeader << " " << segmentCount << endl;
+    if (!file)
+    {
+        Locked(outputStream_) << "Could not write checkpoint '" << filename_ << "'" << endl;
+        return AVERROR(EIO);
+    }
+    file.close();
+
+    for (auto& entry : kept)
+    {
+        int result = Write(entry);
+        if (result < 0)
+            return result;
+    }
+    return 0;
+}
+
+int Checkpoint::Record(const CheckpointEntry& entry)
+{
+    lock_guard<mutex> lock(mutex_);
+    return Write(entry);
+}
+
+int Checkpoint::Write(const CheckpointEntry& entry)
+{
+    ofstream file(filename_, ios::app);
+    file << entry.index << " " << entry.start << " " << entry.end << " " << entry.frameCount << " " << entry.bytes << endl;
+    if (!file)
+    {
+        Locked(outputStream_) << "Could not write checkpoint '" << filename_ << "'" << endl;
+        return AVERROR(EIO);
+    }
+    entries_.push_back(entry);
+    return 0;
+}
+
+void Checkpoint::Remove()
+{
+    remove(filename_.c_str());
+}
+
+int64_t Checkpoint::GetFileSize(const string& filename)
+{
+    ifstream file(filename, ios::binary | ios::ate);
+    if (!file)
+        return -1;
+    return static_cast<int64_t>(file.tellg());
+}
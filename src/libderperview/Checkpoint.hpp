@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <iostream>
+#include <cstdint>
+
+namespace DerperView
+{
+    // A segment that was encoded and closed off, so it won't need doing again
+    struct CheckpointEntry
+    {
+        unsigned int index;
+        int64_t start; // the input timestamps it covers, as Segment has them
+        int64_t end;
+        int64_t frameCount;
+        int64_t bytes; // size of its file when it was finished, so a damaged one can be spotted
+    };
+
+    // Keeps a record next to the output of which segments of a job are done, written as each one finishes. A job
+    // that was killed part way can then be resumed with only the segments that weren't finished still to do.
+    class Checkpoint
+    {
+    public:
+        Checkpoint(std::string outputFilename, std::ostream& outputStream = std::cout);
+
+        // Reads in what an earlier run got done. Returns false if there's nothing to go on.
+        bool Load();
+        unsigned int GetSegmentCount() const { return segmentCount_; }
+        const std::vector<CheckpointEntry>& GetEntries() const { return entries_; }
+
+        // Starts the file over for a job of segmentCount segments, keeping whatever's been loaded that's still good
+        int Start(unsigned int segmentCount, const std::vector<CheckpointEntry>& keep);
+
+        // Adds a finished segment, flushed out to the file before it returns. Safe to call from the threads
+        // running the segments.
+        int Record(const CheckpointEntry& entry);
+
+        void Remove();
+        const std::string& GetFilename() const { return filename_; }
+
+        static int64_t GetFileSize(const std::string& filename);
+
+    protected:
+        int Write(const CheckpointEntry& entry);
+
+        std::string filename_;
+        std::ostream& outputStream_;
+        unsigned int segmentCount_;
+        std::vector<CheckpointEntry> entries_;
+        std::mutex mutex_;
+    };
+}
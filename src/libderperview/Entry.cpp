@@ -1,158 +1,495 @@
 #include <cstring>
 #include <sstream>
 #include <cmath>
-#include <thread>
 #include <algorithm>
 #include <functional>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include "libderperview.hpp"
+#include "Pipeline.hpp"
 #include "Process.hpp"
+#include "Segmenter.hpp"
+#include "Checkpoint.hpp"
+#include "Progress.hpp"
+#include "ThreadPool.hpp"
+#include "ThreadTuner.hpp"
 #include "Video.hpp"
 
 using namespace std;
 using namespace DerperView;
 
-int Go(const string inputFilename, const string outputFilename, const int totalThreads, ostream& outputStream, function<void(int)> callback, const bool& cancel)
+int Go(const string inputFilename, const string outputFilename, const int totalThreads, ostream& outputStream, ProgressCallback callback, const CancelToken& cancel)
+{
+    Settings settings;
+    settings.threads = totalThreads;
+    return Go(inputFilename, outputFilename, settings, outputStream, callback, cancel);
+}
+
+// Audio the output container can take as it is gets copied across, anything else is re-encoded
+AudioMode ChooseAudioMode(const VideoInfo& inputVideoInfo, const string& outputFilename, const Settings& settings)
+{
+    if (settings.noAudio)
+        return AudioMode::None;
+    if (inputVideoInfo.audioMode == AudioMode::Encode && OutputVideoFile::CanCopyAudio(outputFilename, inputVideoInfo.audioCodecParameters->codec_id))
+        return AudioMode::Copy;
+    return inputVideoInfo.audioMode;
+}
+
+// How a pipeline's threads are shared out. They all come out of the one total, so the stretch's pool, the
+// encoder's own threads and any the decoder has of its own never add up to more than it was given, beyond the
+// one each of them needs whatever the total.
+struct ThreadBudget
+{
+    int stretch; // threads the pool starts with
+    int stretchMost; // threads in the pool, the most the tuner can give the stretch
+    int encoder;
+    int decoder; // the decoder's thread_count, 1 for none of its own
+};
+
+// The decoder's share doesn't depend on the video, so it can be worked out before the input's opened
+int GetDecoderThreadCount(int totalThreads, const Settings& settings)
+{
+    if (settings.decoderThreads == AutoThreads)
+        return max(1, totalThreads / 4);
+    return max(1, settings.decoderThreads);
+}
+
+// The stretch starts from the tuner's guess, and the encoder gets what's left. The encoder's thread count is
+// fixed once it's open, so the stretch can only grow by overlapping it: the pool has up to half of the encoder's
+// threads on top of the guess, which the tuner only uses when the stretch is what's keeping the encoder waiting.
+ThreadBudget GetThreadBudget(int totalThreads, int decoderThreads, int width, int height)
+{
+    ThreadBudget budget;
+    budget.decoder = decoderThreads;
+    int rest = max(1, totalThreads - (decoderThreads - 1));
+    budget.stretch = max(1, min(static_cast<int>(ThreadTuner::GetInitialThreadCount(rest, width, height)), rest - 1));
+    budget.encoder = max(1, rest - budget.stretch);
+    budget.stretchMost = budget.stretch + budget.encoder / 2;
+    return budget;
+}
+
+int GetDecoderThreadType(const Settings& settings)
+{
+    switch (settings.decoderThreading)
+    {
+    case DecoderThreading::Frame:
+        return FF_THREAD_FRAME;
+    case DecoderThreading::Slice:
+        return FF_THREAD_SLICE;
+    default:
+        return FF_THREAD_FRAME | FF_THREAD_SLICE;
+    }
+}
+
+string DescribeDecoderThreads(const InputVideoFile& input)
+{
+    int type = input.GetDecoderThreadType();
+    if (type & FF_THREAD_FRAME)
+        return to_string(input.GetDecoderThreadCount()) + " frame threads";
+    if (type & FF_THREAD_SLICE)
+        return to_string(input.GetDecoderThreadCount()) + " slice threads";
+    return "no threads of its own";
+}
+
+// Only said if it happened, most codecs never call execute on a single slice context
+void ReportPoolExecutes(int64_t decoderCalls, int64_t encoderCalls, ostream& outputStream)
+{
+    if (decoderCalls > 0 || encoderCalls > 0)
+        Locked(outputStream) << "Codec slice jobs run on the pool: " << decoderCalls << " times by the decoder, " << encoderCalls << " by the encoder" << endl;
+}
+
+// How long the decode thread spent decoding, against how long the run took, and how long it spent waiting
+void ReportDecodeTime(chrono::nanoseconds decodeTime, chrono::nanoseconds waitTime, chrono::nanoseconds runTime, int64_t frameCount, ostream& outputStream)
 {
-    InputVideoFile input(inputFilename);
+    int64_t decodeMilliseconds = chrono::duration_cast<chrono::milliseconds>(decodeTime).count();
+    int64_t runMilliseconds = chrono::duration_cast<chrono::milliseconds>(runTime).count();
+    int64_t percentage = runMilliseconds > 0 ? decodeMilliseconds * 100 / runMilliseconds : 0;
+    Locked(outputStream) << "Decoding: " << decodeMilliseconds << " ms of " << runMilliseconds << " ms (" << percentage << "%), "
+        << static_cast<double>(decodeMilliseconds) / max<int64_t>(1, frameCount) << " ms per frame, "
+        << chrono::duration_cast<chrono::milliseconds>(waitTime).count() << " ms waiting on the stretch and encoder" << endl;
+    if (percentage >= 90)
+        Locked(outputStream) << "The decoder's what's holding things up, try giving it threads with --decoder-threads" << endl;
+}
+
+// How the input file's time split between reading it and decoding it
+void ReportDemuxTime(const DemuxStats& stats, ostream& outputStream)
+{
+    int64_t waitMilliseconds = chrono::duration_cast<chrono::milliseconds>(stats.waitTime).count();
+    int64_t decodeMilliseconds = chrono::duration_cast<chrono::milliseconds>(stats.decodeTime).count();
+    Locked(outputStream) << "Reading: " << chrono::duration_cast<chrono::milliseconds>(stats.readTime).count() << " ms reading the file, "
+        << waitMilliseconds << " ms waiting on it against " << decodeMilliseconds << " ms decoding, "
+        << stats.peakBytes / (1024 * 1024) << " MB read ahead at most" << endl;
+    if (waitMilliseconds > decodeMilliseconds)
+        Locked(outputStream) << "The file's slower to read than to decode, a bigger --read-ahead might help" << endl;
+}
+
+// Cuts the job into segments at keyframes, runs a pipeline for each of them and joins them up at the end. The
+// pipelines share the pool, and each gets its share of the memory budget. With a segment index, only that
+// segment is encoded and it's left for JoinSegments.
+//
+// With checkpoints the segments are checkpointInterval seconds long and settings.segments of them (or one) are
+// done at a time, with each one written into the checkpoint as it finishes. Resuming picks up the plan from the
+// checkpoint and skips the segments it has that are still intact.
+int GoSegmented(InputVideoFile& input, const string& inputFilename, const string& outputFilename, const VideoInfo& outputVideoInfo, Process& process,
+    int totalThreads, uint64_t frameBytes, const Settings& settings, ostream& outputStream, ProgressReporter& reporter, const CancelToken& cancel)
+{
+    bool oneSegment = settings.segmentIndex >= 0;
+    bool checkpointing = !oneSegment && (settings.checkpointInterval > 0 || settings.resume);
+    Checkpoint checkpoint(outputFilename, outputStream);
+    bool resuming = checkpointing && settings.resume && checkpoint.Load();
+    if (settings.resume && !resuming && !oneSegment)
+        Locked(outputStream) << "Nothing to resume from in '" << checkpoint.GetFilename() << "', starting from the beginning" << endl;
+
+    vector<int64_t> keyframes;
+    if (input.GetKeyframes(keyframes) < 0)
+        return input.GetLastError();
+    unsigned int plannedCount = max(1u, settings.segments);
+    if (resuming)
+        plannedCount = checkpoint.GetSegmentCount();
+    else if (checkpointing && keyframes.size() > 1)
+    {
+        double seconds = (keyframes.back() - keyframes.front()) * av_q2d(input.GetVideoInfo().streamTimeBase);
+        unsigned int interval = settings.checkpointInterval != 0 ? settings.checkpointInterval : DefaultCheckpointInterval;
+        plannedCount = max(plannedCount, static_cast<unsigned int>(ceil(seconds / interval)));
+    }
+
+    Segmenter segmenter(inputFilename, outputFilename, outputStream);
+    segmenter.Plan(keyframes, plannedCount);
+    vector<Segment>& segments = segmenter.GetSegments();
+    unsigned int segmentCount = static_cast<unsigned int>(segments.size());
+    if (oneSegment && static_cast<unsigned int>(settings.segmentIndex) >= segmentCount)
+    {
+        Locked(outputStream) << "Only " << segmentCount << " segments fit between the keyframes, nothing to do for segment " << settings.segmentIndex << endl;
+        return 0;
+    }
+
+    // Anything the checkpoint has that still matches the plan and its file doesn't need doing again
+    vector<bool> done(segmentCount, false);
+    vector<CheckpointEntry> finished;
+    int64_t framesDone = 0;
+    if (resuming)
+    {
+        int64_t bytes = 0;
+        for (auto& entry : checkpoint.GetEntries())
+        {
+            if (entry.index >= segmentCount || done[entry.index] || entry.start != segments[entry.index].start || entry.end != segments[entry.index].end
+                || Checkpoint::GetFileSize(segments[entry.index].filename) != entry.bytes)
+                continue;
+            done[entry.index] = true;
+            segments[entry.index].frameCount = entry.frameCount;
+            finished.push_back(entry);
+            framesDone += entry.frameCount;
+            bytes += entry.bytes;
+        }
+        Locked(outputStream) << "Resuming with " << finished.size() << " of " << segmentCount << " segments already done (" << bytes / (1024 * 1024) << " MB)";
+        auto next = find(done.begin(), done.end(), false);
+        if (next != done.end() && segments[next - done.begin()].start != AV_NOPTS_VALUE)
+            Locked(outputStream) << ", carrying on from input timestamp " << segments[next - done.begin()].start;
+        Locked(outputStream) << endl;
+    }
+    if (checkpointing && checkpoint.Start(segmentCount, finished) < 0)
+        return AVERROR(EIO);
+
+    vector<unsigned int> toDo;
+    for (unsigned int i = 0; i < segmentCount; i++)
+        if (!done[i] && (!oneSegment || i == static_cast<unsigned int>(settings.segmentIndex)))
+            toDo.push_back(i);
+    unsigned int runningCount = max(1u, min(static_cast<unsigned int>(toDo.size()), checkpointing ? max(1u, settings.segments) : segmentCount));
+
+    // Each segment running gets an even share of the threads, split up the same way as a whole job's. The pool
+    // is shared, with room for all of their stretches.
+    int share = max(1, totalThreads / static_cast<int>(runningCount));
+    ThreadBudget budget = GetThreadBudget(share, GetDecoderThreadCount(share, settings), input.GetVideoInfo().width, input.GetVideoInfo().height);
+    unsigned int queueDepth = settings.queueDepth != 0 ? settings.queueDepth : 2 * static_cast<unsigned int>(budget.stretch);
+    unsigned int reorderWindow = settings.reorderWindow != 0 ? settings.reorderWindow : queueDepth + 2;
+    ThreadPool pool(budget.stretch * runningCount);
+
+    // The segments have no audio of their own, it's copied in when they're joined
+    VideoInfo segmentVideoInfo = outputVideoInfo;
+    segmentVideoInfo.audioMode = AudioMode::None;
+    segmentVideoInfo.encoderThreads = budget.encoder;
+
+    Locked(outputStream) << "Running up " << toDo.size() << " of " << segmentCount << " segments, " << runningCount << " at a time with " << totalThreads << " thread" << (totalThreads > 1 ? "s" : "")
+        << " (" << process.GetName() << " kernel, queue depth " << queueDepth << ", reorder window " << reorderWindow << ")..." << endl;
+    Locked(outputStream) << "Each segment's threads: " << budget.stretch << " stretch, " << budget.encoder << " encoder, " << budget.decoder << " decoder" << endl;
+    Locked(outputStream) << "--------------------------------------------------------------------" <<  endl;
+
+    // The percentage counts what an earlier run got done, the frames read at the end don't
+    ProgressCounters& progress = reporter.GetCounters();
+    progress.framesEncoded = framesDone;
+    reporter.Start();
+
+    // Added up over the segments' pipelines and inputs
+    atomic<int64_t> decodeNanoseconds(0), waitNanoseconds(0), runNanoseconds(0);
+    atomic<int64_t> decoderExecutes(0), encoderExecutes(0);
+    mutex demuxMutex;
+    DemuxStats demuxStats = DemuxStats();
+
+    vector<int> results(segmentCount, 0);
+    atomic<size_t> nextToDo(0);
+    vector<thread> workers;
+    for (unsigned int worker = 0; worker < runningCount; worker++)
+    {
+        workers.emplace_back([&]()
+        {
+            for (size_t next = nextToDo++; next < toDo.size() && !cancel.IsCancelled(); next = nextToDo++)
+            {
+                unsigned int i = toDo[next];
+                InputVideoFile segmentInput(inputFilename, outputStream, false, budget.decoder, GetDecoderThreadType(settings));
+                results[i] = segmentInput.GetLastError();
+                if (results[i] == 0)
+                {
+                    segmentInput.SetThreadPool(pool);
+                    segmentInput.SetReadAhead(settings.readAheadSize / runningCount);
+                    segmentInput.SetAudioMode(AudioMode::None);
+                    results[i] = segmentInput.SetRange(segments[i].start, segments[i].end);
+                }
+                if (results[i] != 0)
+                    return;
+
+                {
+                    OutputVideoFile segmentOutput(segments[i].filename, segmentVideoInfo, outputStream, settings.ioBufferSize != 0 ? settings.ioBufferSize : OutputVideoFile::DefaultIoBufferSize);
+                    results[i] = segmentOutput.GetLastError();
+                    if (results[i] != 0)
+                        return;
+                    segmentOutput.SetProgress(&progress);
+                    segmentOutput.SetThreadPool(pool);
+
+                    Pipeline pipeline(segmentInput, segmentOutput, process, pool, nullptr, queueDepth, reorderWindow, outputStream, &progress);
+                    pipeline.SetMemoryBudget(settings.maxMemory / runningCount, frameBytes);
+                    pipeline.EnableBands();
+                    results[i] = pipeline.Run(cancel);
+                    if (results[i] == 0)
+                        results[i] = segmentOutput.GetLastError();
+                    if (results[i] == 0 && !cancel.IsCancelled())
+                        results[i] = segmentOutput.Flush();
+                    segments[i].frameCount = pipeline.GetFrameCount();
+                    decodeNanoseconds += pipeline.GetDecodeTime().count();
+                    waitNanoseconds += pipeline.GetDecodeWaitTime().count();
+                    runNanoseconds += pipeline.GetRunTime().count();
+                    decoderExecutes += segmentInput.GetPoolExecuteCount();
+                    encoderExecutes += segmentOutput.GetPoolExecuteCount();
+
+                    DemuxStats segmentStats = segmentInput.GetDemuxStats();
+                    lock_guard<mutex> lock(demuxMutex);
+                    demuxStats.readTime += segmentStats.readTime;
+                    demuxStats.waitTime += segmentStats.waitTime;
+                    demuxStats.decodeTime += segmentStats.decodeTime;
+                    demuxStats.peakBytes = max(demuxStats.peakBytes, segmentStats.peakBytes);
+                }
+                if (results[i] != 0)
+                    return;
+
+                // Closed off with its trailer written, so it's done unless it was cut short
+                if (checkpointing && !cancel.IsCancelled())
+                    results[i] = checkpoint.Record({ i, segments[i].start, segments[i].end, segments[i].frameCount, Checkpoint::GetFileSize(segments[i].filename) });
+            }
+        });
+    }
+    for (auto& worker : workers)
+        worker.join();
+    reporter.Stop();
+
+    int64_t framesEncoded = progress.framesEncoded - framesDone;
+    Locked(outputStream) << endl;
+    for (unsigned int i : toDo)
+    {
+        Locked(outputStream) << "Segment " << i << ": " << segments[i].frameCount << " frames" << endl;
+        if (results[i] != 0)
+            return results[i];
+    }
+    Locked(outputStream) << "Segments written: " << progress.bytesWritten / (1024 * 1024) << " MB" << endl;
+    ReportDecodeTime(chrono::nanoseconds(decodeNanoseconds.load()), chrono::nanoseconds(waitNanoseconds.load()), chrono::nanoseconds(runNanoseconds.load()), framesEncoded, outputStream);
+    ReportDemuxTime(demuxStats, outputStream);
+    ReportPoolExecutes(decoderExecutes, encoderExecutes, outputStream);
+    if (cancel.IsCancelled() || oneSegment)
+    {
+        Locked(outputStream) << "Frames read: " << framesEncoded << endl;
+        if (!cancel.IsCancelled())
+            return 0;
+
+        // Without a checkpoint to carry on from, what's been done so far is no use to anyone
+        if (checkpointing)
+            Locked(outputStream) << "Stopped part way, run again with --resume to carry on" << endl;
+        else
+        {
+            for (unsigned int i : toDo)
+                segmenter.RemoveSegmentFile(i);
+            Locked(outputStream) << "Cancelled, the segments written so far have been removed" << endl;
+        }
+        return AVERROR_EXIT;
+    }
+
+    int result = segmenter.Join(outputVideoInfo.frameRate, outputVideoInfo.audioMode);
+    if (result < 0)
+        return result;
+    segmenter.RemoveSegmentFiles();
+    if (checkpointing)
+        checkpoint.Remove();
+
+    Locked(outputStream) << "Frames read: " << framesEncoded << endl;
+    Locked(outputStream) << "--------------------------------------------------------------------" << endl;
+    return 0;
+}
+
+int Go(const string inputFilename, const string outputFilename, const Settings& settings, ostream& outputStream, ProgressCallback callback, const CancelToken& cancel)
+{
+    // The one total everything's threads come out of. On auto it's a thread for every core.
+    bool autoThreads = settings.threads == AutoThreads;
+    int totalThreads = autoThreads ? max(1u, thread::hardware_concurrency()) : max(1, settings.threads);
+    int decoderThreads = GetDecoderThreadCount(totalThreads, settings);
+
+    InputVideoFile input(inputFilename, outputStream, false, decoderThreads, GetDecoderThreadType(settings));
     if (input.GetLastError() != 0)
         return input.GetLastError();
     input.Dump();
     
     auto inputVideoInfo = input.GetVideoInfo();
 
-    if (
-        inputVideoInfo.pixelFormat != AVPixelFormat::AV_PIX_FMT_YUV420P
-        && inputVideoInfo.pixelFormat != AVPixelFormat::AV_PIX_FMT_YUVJ420P
-    )
+    unique_ptr<Process> process = Process::Create(inputVideoInfo.pixelFormat, inputVideoInfo.width, inputVideoInfo.height);
+    if (process == nullptr)
     {
         cerr << "Source not in compatible pixel format" << endl;
         return 2;
     }
+    process->SetCancelToken(&cancel);
 
     auto outputVideoInfo = inputVideoInfo; // Copy video info and tweak for output
     outputVideoInfo.width = Process::GetDerpedWidth(inputVideoInfo.width);
     outputVideoInfo.bitRate = static_cast<int>(inputVideoInfo.bitRate * 1.4);
-    OutputVideoFile output(outputFilename, outputVideoInfo);
-    if (output.GetLastError() != 0)
-        return output.GetLastError();
 
-    int64_t percentageMarker = static_cast<int64_t>(floor(static_cast<float>(inputVideoInfo.totalFrames) / 100));
-    int64_t frameCount = 0;
-    int64_t encodedPacketCount = 0;
+    outputVideoInfo.audioMode = ChooseAudioMode(inputVideoInfo, outputFilename, settings);
+    const char *audioModeNames[] = { "none", "re-encoded", "copied" };
+    Locked(outputStream) << "Audio: " << audioModeNames[static_cast<int>(outputVideoInfo.audioMode)] << endl;
+
+    // The stages only bump counters, the reporter's thread does the talking
+    ProgressReporter reporter(inputVideoInfo.totalFrames, outputStream, callback);
 
-    AVFrame *outputFrame = nullptr;
-    vector<vector<unsigned char>> data(totalThreads);
-    vector<vector<unsigned char>> derperviewedData(totalThreads);
-    vector<thread> threads(totalThreads);
-    int threadIndex = 0;
+    // A frame in flight holds a decoded picture and a stretched one
+    uint64_t frameBytes = av_image_get_buffer_size(inputVideoInfo.pixelFormat, inputVideoInfo.width, inputVideoInfo.height, FramePool::Alignment)
+        + av_image_get_buffer_size(outputVideoInfo.pixelFormat, outputVideoInfo.width, outputVideoInfo.height, FramePool::Alignment);
 
-    // Allocate buffers
-    auto frameBufferSize = av_image_get_buffer_size(static_cast<AVPixelFormat>(inputVideoInfo.pixelFormat), inputVideoInfo.width, inputVideoInfo.height, 1);
-    auto derpBufferSize = av_image_get_buffer_size(static_cast<AVPixelFormat>(outputVideoInfo.pixelFormat), outputVideoInfo.width, outputVideoInfo.height, 1);
-    for (int i = 0; i < totalThreads; i++)
+    bool segmented = settings.segments > 1 || settings.checkpointInterval > 0 || settings.resume;
+    if (segmented && outputVideoInfo.audioMode == AudioMode::Encode)
     {
-        data[i].resize(frameBufferSize);
-        derperviewedData[i].resize(derpBufferSize);
+        // Segment 0 does the lot when it's one of several separate runs
+        Locked(outputStream) << "Audio has to be re-encoded, which can't be done in segments or checkpointed, so doing it all in one go" << endl;
+        if (settings.segmentIndex > 0)
+            return 0;
     }
+    else if (segmented)
+        return GoSegmented(input, inputFilename, outputFilename, outputVideoInfo, *process, totalThreads, frameBytes, settings, outputStream, reporter, cancel);
 
-    unique_ptr<Process> process = make_unique<CpuProcess>(inputVideoInfo.width, inputVideoInfo.height);
-    
-    outputStream << "Running up with " << totalThreads << " thread" << (totalThreads > 1 ? "s" : "") << "..." << endl;
-    outputStream << "--------------------------------------------------------------------" <<  endl;
+    // The pool is built with the most the stretch may use, and the tuner starts it at the guess and moves it
+    // within that
+    ThreadBudget budget = GetThreadBudget(totalThreads, decoderThreads, inputVideoInfo.width, inputVideoInfo.height);
+    outputVideoInfo.encoderThreads = budget.encoder;
 
-    auto frame = input.GetNextFrame();
-    while (frame != nullptr && !cancel)
-    {
-        if (frame->width == 0) // Audio - stream it through
-        {
-            output.WriteNextFrame(frame);
-        }
-        else // Video, stretch that bad boy.
-        {
-            // Copy data into a contiguous buffer we can mess with
-            auto copyResult = av_image_copy_to_buffer(data[threadIndex].data(), frameBufferSize, frame->data, frame->linesize, static_cast<AVPixelFormat>(frame->format), frame->width, frame->height, 1);
+    OutputVideoFile output(outputFilename, outputVideoInfo, outputStream, settings.ioBufferSize != 0 ? settings.ioBufferSize : OutputVideoFile::DefaultIoBufferSize);
+    if (output.GetLastError() != 0)
+        return output.GetLastError();
+    output.SetProgress(&reporter.GetCounters());
 
-            // Set up thread to perform the stretchy stuff
-            if (inputVideoInfo.pixelFormat == AVPixelFormat::AV_PIX_FMT_YUV420P || inputVideoInfo.pixelFormat == AVPixelFormat::AV_PIX_FMT_YUVJ420P)
-                threads[threadIndex] = thread(&Process::DerpIt, ref(*process), ref(data[threadIndex]), ref(derperviewedData[threadIndex]));
-            threadIndex ++;
+    // With Encode the pipeline's audio stage takes the packets, and with None they're thrown away
+    if (outputVideoInfo.audioMode == AudioMode::Copy)
+        input.SetAudioMode(AudioMode::Copy, [&output](AVPacket *packet) { output.WriteAudioPacket(packet); });
 
-            // If we've got all of our threads, then join the lot and write them to the output
-            if (threadIndex >= totalThreads)
-            {
-                for (int i = 0; i < totalThreads; i ++)
-                    threads[i].join();
+    unsigned int queueDepth = settings.queueDepth != 0 ? settings.queueDepth : 2 * static_cast<unsigned int>(budget.stretchMost);
+    unsigned int reorderWindow = settings.reorderWindow != 0 ? settings.reorderWindow : queueDepth + 2;
+    ThreadPool pool(budget.stretchMost);
+    input.SetThreadPool(pool);
+    input.SetReadAhead(settings.readAheadSize);
+    output.SetThreadPool(pool);
+    ThreadTuner tuner(pool, budget.stretch);
+    Pipeline pipeline(input, output, *process, pool, &tuner, queueDepth, reorderWindow, outputStream, &reporter.GetCounters());
 
-                for (int i = 0; i < totalThreads; i++)
-                {
-                    // Put new data into an AVFrame
-                    outputFrame = av_frame_alloc();
-                    outputFrame->width = outputVideoInfo.width;
-                    outputFrame->height = outputVideoInfo.height;
-                    outputFrame->format = outputVideoInfo.pixelFormat;
-                    outputFrame->pts = frameCount;
-                    av_image_fill_arrays(outputFrame->data, outputFrame->linesize, reinterpret_cast<uint8_t *>(derperviewedData[i].data()), static_cast<AVPixelFormat>(outputFrame->format), outputFrame->width, outputFrame->height, 1);
-
-                    encodedPacketCount += output.WriteNextFrame(outputFrame);
-
-                    av_frame_free(&outputFrame);
-                    frameCount++;
-
-                    if (frameCount % percentageMarker == 0)
-                    {
-                        int percentage = ceil(static_cast<float>(frameCount) * 100 / inputVideoInfo.totalFrames);
-                        outputStream << " " << percentage << "% ";
-                        outputStream.flush();
-
-                        if (callback != nullptr)
-                        {
-                            callback(percentage);
-                        }
-                    }
-                    else if (frameCount % 5 == 0)
-                    {
-                        outputStream << ".";
-                        outputStream.flush();
-                    }
-                }
+    pipeline.SetMemoryBudget(settings.maxMemory, frameBytes);
+    bool bands = pipeline.EnableBands();
+    if (outputVideoInfo.audioMode == AudioMode::Encode)
+        pipeline.EnableAudioStage();
+    if (settings.maxMemory != 0)
+        Locked(outputStream) << "Memory budget: " << settings.maxMemory / (1024 * 1024) << " MB, room for " << max<uint64_t>(1, settings.maxMemory / frameBytes) << " frames in flight" << endl;
 
-                threadIndex = 0;
-            }
-        }
+    Locked(outputStream) << "Running up with " << totalThreads << " thread" << (totalThreads > 1 ? "s" : "") << (autoThreads ? ", one for each core" : "")
+        << " (" << process->GetName() << " kernel, queue depth " << queueDepth << ", reorder window " << reorderWindow << ")..." << endl;
+    Locked(outputStream) << "Threads: " << budget.stretch << " stretch, adjusting up to " << budget.stretchMost << " as it goes, " << budget.encoder << " encoder, decoder has " << DescribeDecoderThreads(input) << endl;
+    Locked(outputStream) << "--------------------------------------------------------------------" <<  endl;
 
-        frame = input.GetNextFrame();
-    }
+    reporter.Start();
+    int result = pipeline.Run(cancel);
+    reporter.Stop();
+    if (result == 0)
+        result = output.GetLastError();
 
-    // Clear left-over frames out of the thread buffer
-    for (int i = 0; i < threadIndex; i++)
-        threads[i].join();
+    // Draining the encoder's lookahead can take a while at 4K, and a cancelled job doesn't want what's in it, only
+    // what's already made it to the muxer
+    if (result == 0)
+        result = cancel.IsCancelled() ? output.Close() : output.Flush();
 
-    for (int i = 0; i < threadIndex; i++)
+    Locked(outputStream) << endl;
+    if (result < 0)
+        Locked(outputStream) << "Stopped, the output couldn't be written: " << GetErrorString(result) << endl;
+    else if (cancel.IsCancelled())
     {
-        outputFrame = av_frame_alloc();
-        outputFrame->width = outputVideoInfo.width;
-        outputFrame->height = outputVideoInfo.height;
-        outputFrame->format = outputVideoInfo.pixelFormat;
-        outputFrame->pts = frameCount;
-        av_image_fill_arrays(outputFrame->data, outputFrame->linesize, reinterpret_cast<uint8_t *>(derperviewedData[i].data()), static_cast<AVPixelFormat>(outputFrame->format), outputFrame->width, outputFrame->height, 1);
-
-        encodedPacketCount += output.WriteNextFrame(outputFrame);
-
-        av_frame_free(&outputFrame);
-        frameCount++;
-
-        if (frameCount % percentageMarker == 0)
-            outputStream << " " << ceil(static_cast<float>(frameCount) * 100 / inputVideoInfo.totalFrames) << "% ";
-        else if (frameCount % 5 == 0)
-            outputStream << ".";
+        Locked(outputStream) << "Cancelled, the output has the " << output.GetMuxedVideoFrameCount() << " frames written by then" << endl;
+        result = AVERROR_EXIT;
     }
+    Locked(outputStream) << "Encoded packet count: " << pipeline.GetEncodedPacketCount() << endl;
+    Locked(outputStream) << "Frames read: " << pipeline.GetFrameCount() << endl;
+    if (outputVideoInfo.audioMode == AudioMode::Encode)
+        Locked(outputStream) << "Audio frames re-encoded: " << pipeline.GetAudioFrameCount() << endl;
+    if (bands)
+        Locked(outputStream) << "Stretched in bands as they were decoded: " << pipeline.GetBandFrameCount() << " frames" << endl;
+    ReportDecodeTime(pipeline.GetDecodeTime(), pipeline.GetDecodeWaitTime(), pipeline.GetRunTime(), pipeline.GetFrameCount(), outputStream);
+    ReportDemuxTime(input.GetDemuxStats(), outputStream);
+    ReportPoolExecutes(input.GetPoolExecuteCount(), output.GetPoolExecuteCount(), outputStream);
+    Locked(outputStream) << "Stretch threads: started with " << tuner.GetInitialThreads() << ", finished with " << tuner.GetThreads() << " after " << tuner.GetAdjustmentCount() << " adjustments" << endl;
+    AllocationCounts allocations = pipeline.GetSteadyStateAllocations();
+    int64_t steadyFrames = max<int64_t>(1, pipeline.GetSteadyStateFrameCount());
+    Locked(outputStream) << "Allocations after warm up: " << allocations.allocations << " (" << static_cast<double>(allocations.allocations) / steadyFrames << " per frame), "
+        << allocations.bytes << " bytes (" << allocations.bytes / steadyFrames << " per frame)" << endl;
+    Locked(outputStream) << "Mux queue: " << output.GetMuxQueueHighWater() << " of " << OutputVideoFile::MuxQueueDepth << " packets at most" << endl;
+    Locked(outputStream) << "Peak in flight: " << pipeline.GetPeakInFlightBytes() / (1024 * 1024) << " MB" << endl;
+    ReorderStats reorderStats = pipeline.GetReorderStats();
+    Locked(outputStream) << "Reorder buffer: " << reorderStats.peakOccupancy << " peak, " << reorderStats.meanOccupancy << " mean occupancy, "
+        << (reorderStats.itemCount > 0 ? reorderStats.totalWait.count() / reorderStats.itemCount : 0) << "us mean, " << reorderStats.maxWait.count() << "us max wait" << endl;
+    FramePoolStats poolStats = input.GetFramePoolStats();
+    Locked(outputStream) << "Decoder frame pool: " << poolStats.hits << " reused, " << poolStats.misses << " allocated, " << poolStats.peakBytes / (1024 * 1024) << " MB peak" << endl;
+    poolStats = output.GetFramePoolStats();
+    Locked(outputStream) << "Encoder frame pool: " << poolStats.hits << " reused, " << poolStats.misses << " allocated, " << poolStats.peakBytes / (1024 * 1024) << " MB peak" << endl;
 
-    output.Flush();
+    Locked(outputStream) << "--------------------------------------------------------------------" << endl;
 
-    outputStream << endl;
-    outputStream << "Encoded packet count: " << encodedPacketCount << endl;
-    outputStream << "Frames read: " << frameCount << endl;
+    return result;
+}
 
-    outputStream << "--------------------------------------------------------------------" << endl;
+int JoinSegments(const string inputFilename, const string outputFilename, const Settings& settings, ostream& outputStream)
+{
+    InputVideoFile input(inputFilename, outputStream);
+    if (input.GetLastError() != 0)
+        return input.GetLastError();
+
+    auto inputVideoInfo = input.GetVideoInfo();
+    AudioMode audioMode = ChooseAudioMode(inputVideoInfo, outputFilename, settings);
+    if (audioMode == AudioMode::Encode)
+    {
+        Locked(outputStream) << "Audio has to be re-encoded, so segment 0 wrote the whole output and there's nothing to join" << endl;
+        return 0;
+    }
 
+    // Planned the same way as when the segments were encoded, so it comes up with the same files
+    Segmenter segmenter(inputFilename, outputFilename, outputStream);
+    vector<int64_t> keyframes;
+    if (input.GetKeyframes(keyframes) < 0)
+        return input.GetLastError();
+    segmenter.Plan(keyframes, settings.segments);
+    Locked(outputStream) << "Joining " << segmenter.GetSegments().size() << " segments" << endl;
+    int result = segmenter.Join(inputVideoInfo.frameRate, audioMode);
+    if (result < 0)
+        return result;
+    segmenter.RemoveSegmentFiles();
     return 0;
 }
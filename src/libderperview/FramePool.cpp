@@ -0,0 +1,251 @@
+#include "FramePool.hpp"
+#include "AllocationCounter.hpp"
+
+extern "C"
+{
+    #include "libavutil/imgutils.h"
+    #include "libavutil/pixdesc.h"
+}
+
+#include <algorithm>
+#include <cstdlib>
+
+#if defined(_WIN32)
+    #define NOMINMAX
+    #include <windows.h>
+#elif defined(__linux__)
+    #include <sys/mman.h>
+#endif
+
+using namespace DerperView;
+using namespace std;
+
+namespace
+{
+    // Sits in front of every block so Free knows how the block was allocated
+    struct BlockHeader
+    {
+        void *base;
+        size_t size;
+        bool mapped;
+    };
+
+    const size_t HeaderSize = FramePool::Alignment; // keeps the data after the header aligned
+    const size_t HugePageSize = 2 * 1024 * 1024;
+
+    uint8_t *AllocateBlock(size_t size, bool useHugePages)
+    {
+        size_t total = size + HeaderSize;
+        void *base = nullptr;
+        bool mapped = false;
+
+        if (useHugePages)
+        {
+            size_t rounded = (total + HugePageSize - 1) / HugePageSize * HugePageSize;
+#if defined(_WIN32)
+            // Needs SeLockMemoryPrivilege, so this fails for most users and we drop through to the heap
+            size_t largePage = GetLargePageMinimum();
+            if (largePage != 0)
+            {
+                rounded = (total + largePage - 1) / largePage * largePage;
+                base = VirtualAlloc(nullptr, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            }
+#elif defined(__linux__)
+            base = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (base == MAP_FAILED)
+                base = nullptr;
+    #ifdef MADV_HUGEPAGE
+            else
+                madvise(base, rounded, MADV_HUGEPAGE);
+    #endif
+#endif
+            if (base != nullptr)
+            {
+                total = rounded;
+                mapped = true;
+            }
+        }
+
+        uint8_t *data = static_cast<uint8_t *>(base) + HeaderSize;
+        if (base == nullptr)
+        {
+            // av_malloc only promises as much alignment as the widest SIMD ffmpeg was built for, so line it up ourselves
+            base = av_malloc(total + FramePool::Alignment);
+            if (base == nullptr)
+                return nullptr;
+            uintptr_t aligned = (reinterpret_cast<uintptr_t>(base) + HeaderSize + FramePool::Alignment - 1) & ~static_cast<uintptr_t>(FramePool::Alignment - 1);
+            data = reinterpret_cast<uint8_t *>(aligned);
+        }
+
+        BlockHeader *header = reinterpret_cast<BlockHeader *>(data - HeaderSize);
+        header->base = base;
+        header->size = total;
+        header->mapped = mapped;
+        return data;
+    }
+
+    void FreeBlock(uint8_t *data)
+    {
+        BlockHeader *header = reinterpret_cast<BlockHeader *>(data - HeaderSize);
+        if (!header->mapped)
+        {
+            av_free(header->base);
+            return;
+        }
+#if defined(_WIN32)
+        VirtualFree(header->base, 0, MEM_RELEASE);
+#elif defined(__linux__)
+        munmap(header->base, header->size);
+#endif
+    }
+
+    size_t AlignUp(size_t value, size_t alignment)
+    {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+}
+
+FramePool::FramePool(bool useHugePages) :
+    useHugePages_(useHugePages),
+    counters_(make_shared<Counters>()),
+    pool_(nullptr),
+    bufferSize_(0)
+{
+    counters_->hits = 0;
+    counters_->misses = 0;
+    counters_->currentBytes = 0;
+    counters_->peakBytes = 0;
+}
+
+FramePool::~FramePool()
+{
+    // Buffers still out in frames keep the AVBufferPool alive until they come back
+    av_buffer_pool_uninit(&pool_);
+}
+
+AVBufferRef *FramePool::Allocate(void *opaque, size_t size)
+{
+    PoolInfo *info = static_cast<PoolInfo *>(opaque);
+    uint8_t *data = AllocateBlock(size, info->useHugePages);
+    if (data == nullptr)
+        return nullptr;
+
+    AVBufferRef *buffer = av_buffer_create(data, size, &FramePool::Free, info, 0);
+    if (buffer == nullptr)
+    {
+        FreeBlock(data);
+        return nullptr;
+    }
+
+    AllocationCounter::Record(size);
+    Counters& counters = *info->counters;
+    counters.misses++;
+    uint64_t current = counters.currentBytes += size;
+    uint64_t peak = counters.peakBytes;
+    while (current > peak && !counters.peakBytes.compare_exchange_weak(peak, current)) { }
+    return buffer;
+}
+
+void FramePool::Free(void *opaque, uint8_t *data)
+{
+    PoolInfo *info = static_cast<PoolInfo *>(opaque);
+    info->counters->currentBytes -= info->bufferSize;
+    FreeBlock(data);
+}
+
+void FramePool::FreePool(void *opaque)
+{
+    delete static_cast<PoolInfo *>(opaque);
+}
+
+int FramePool::GetFrameBuffer(AVFrame *frame, int alignedWidth, int alignedHeight, const int linesizeAlign[AV_NUM_DATA_POINTERS])
+{
+    AVPixelFormat format = static_cast<AVPixelFormat>(frame->format);
+
+    // Work out the row pitch for each plane, rounded up so every row starts on a cache line
+    int linesize[4] = { 0 };
+    int result = av_image_fill_linesizes(linesize, format, alignedWidth);
+    if (result < 0)
+        return result;
+    for (int plane = 0; plane < 4; plane++)
+        if (linesize[plane] != 0)
+            linesize[plane] = static_cast<int>(AlignUp(linesize[plane], max(Alignment, linesizeAlign[plane])));
+
+    ptrdiff_t linesize1[4];
+    for (int plane = 0; plane < 4; plane++)
+        linesize1[plane] = linesize[plane];
+    size_t planeSize[4] = { 0 };
+    result = av_image_fill_plane_sizes(planeSize, format, alignedHeight, linesize1);
+    if (result < 0)
+        return result;
+
+    // All planes share one buffer, each padded so reading a vector past the end of the last row is safe
+    size_t offset[4] = { 0 };
+    size_t size = 0;
+    for (int plane = 0; plane < 4 && planeSize[plane] != 0; plane++)
+    {
+        offset[plane] = size;
+        size += AlignUp(planeSize[plane] + PlanePadding, Alignment);
+    }
+
+    AVBufferRef *buffer = nullptr;
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (pool_ == nullptr || bufferSize_ != size)
+        {
+            // Frame size changed mid stream. The old pool hangs around until its last buffer comes back.
+            av_buffer_pool_uninit(&pool_);
+            PoolInfo *info = new PoolInfo { counters_, size, useHugePages_ };
+            pool_ = av_buffer_pool_init2(size, info, &FramePool::Allocate, &FramePool::FreePool);
+            if (pool_ == nullptr)
+            {
+                delete info;
+                return AVERROR(ENOMEM);
+            }
+            bufferSize_ = size;
+        }
+
+        uint64_t misses = counters_->misses;
+        buffer = av_buffer_pool_get(pool_);
+        if (buffer != nullptr && counters_->misses == misses)
+            counters_->hits++;
+    }
+    if (buffer == nullptr)
+        return AVERROR(ENOMEM);
+
+    frame->buf[0] = buffer;
+    for (int plane = 0; plane < 4; plane++)
+    {
+        frame->data[plane] = planeSize[plane] != 0 ? buffer->data + offset[plane] : nullptr;
+        frame->linesize[plane] = planeSize[plane] != 0 ? linesize[plane] : 0;
+    }
+    frame->extended_data = frame->data;
+    return 0;
+}
+
+int FramePool::GetBuffer(AVCodecContext *context, AVFrame *frame, int flags)
+{
+    const AVPixFmtDescriptor *descriptor = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(frame->format));
+
+    // Hardware frames, palettes and codecs that can't decode into someone else's buffers get the usual treatment
+    bool plainImage = descriptor != nullptr && !(descriptor->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM));
+    if (!plainImage || !(context->codec->capabilities & AV_CODEC_CAP_DR1))
+        return avcodec_default_get_buffer2(context, frame, flags);
+
+    int width = frame->width;
+    int height = frame->height;
+    int linesizeAlign[AV_NUM_DATA_POINTERS];
+    avcodec_align_dimensions2(context, &width, &height, linesizeAlign);
+
+    return GetFrameBuffer(frame, width, height, linesizeAlign);
+}
+
+FramePoolStats FramePool::GetStats() const
+{
+    FramePoolStats stats;
+    stats.hits = counters_->hits;
+    stats.misses = counters_->misses;
+    stats.currentBytes = counters_->currentBytes;
+    stats.peakBytes = counters_->peakBytes;
+    return stats;
+}
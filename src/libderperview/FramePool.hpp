@@ -0,0 +1,74 @@
+#pragma once
+
+extern "C"
+{
+    #include "libavcodec/avcodec.h"
+    #include "libavutil/buffer.h"
+}
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+namespace DerperView
+{
+    struct FramePoolStats
+    {
+        uint64_t hits; // Frames handed out from buffers that were already allocated
+        uint64_t misses; // Frames that needed a new buffer
+        uint64_t currentBytes; // Bytes allocated right now, in use or waiting in the pool
+        uint64_t peakBytes;
+    };
+
+    // Hands out video frames whose planes live in buffers we allocate ourselves: 64 byte aligned, rows padded
+    // to a multiple of 64 bytes and some slack after each plane so vector code can read a little past the
+    // end of a row. Optionally the buffers are backed by huge pages. Released buffers go back to an
+    // AVBufferPool, so once the pool has warmed up nothing gets allocated.
+    class FramePool
+    {
+    public:
+        FramePool(bool useHugePages = false);
+        virtual ~FramePool();
+
+        // Gives frame (which must already have width, height and format set) planes from the pool. The extra
+        // alignment requirements come from avcodec_align_dimensions2 when filling frames for a decoder.
+        int GetFrameBuffer(AVFrame *frame, int alignedWidth, int alignedHeight, const int linesizeAlign[AV_NUM_DATA_POINTERS]);
+
+        // For an AVCodecContext::get_buffer2 to hand on to. Falls back to libavcodec's own allocator for anything
+        // that isn't a plain software video frame.
+        int GetBuffer(AVCodecContext *context, AVFrame *frame, int flags);
+
+        FramePoolStats GetStats() const;
+
+        static const int Alignment = 64;
+        static const int PlanePadding = 64 + AV_INPUT_BUFFER_PADDING_SIZE;
+
+    protected:
+        // Outlives the FramePool if frames are still holding on to buffers when it goes away
+        struct Counters
+        {
+            std::atomic<uint64_t> hits;
+            std::atomic<uint64_t> misses;
+            std::atomic<uint64_t> currentBytes;
+            std::atomic<uint64_t> peakBytes;
+        };
+
+        struct PoolInfo
+        {
+            std::shared_ptr<Counters> counters;
+            size_t bufferSize;
+            bool useHugePages;
+        };
+
+        static AVBufferRef *Allocate(void *opaque, size_t size);
+        static void Free(void *opaque, uint8_t *data);
+        static void FreePool(void *opaque);
+
+        bool useHugePages_;
+        std::shared_ptr<Counters> counters_;
+        mutable std::mutex mutex_;
+        AVBufferPool *pool_;
+        size_t bufferSize_;
+    };
+}
@@ -0,0 +1,33 @@
+#include "MemoryBudget.hpp"
+
+#include <algorithm>
+
+using namespace DerperView;
+using namespace std;
+
+MemoryBudget::MemoryBudget(uint64_t limit) : limit_(limit), current_(0), peak_(0)
+{
+}
+
+void MemoryBudget::Acquire(uint64_t bytes)
+{
+    unique_lock<mutex> lock(mutex_);
+    if (limit_ != 0)
+        released_.wait(lock, [this, bytes] { return current_ == 0 || current_ + bytes <= limit_; });
+
+    current_ += bytes;
+    peak_ = max(peak_, current_);
+}
+
+void MemoryBudget::Release(uint64_t bytes)
+{
+    lock_guard<mutex> lock(mutex_);
+    current_ -= bytes;
+    released_.notify_all();
+}
+
+uint64_t MemoryBudget::GetPeak() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return peak_;
+}
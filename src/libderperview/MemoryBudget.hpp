@@ -0,0 +1,31 @@
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+namespace DerperView
+{
+    // Keeps count of the bytes held by frames in flight, and makes whoever wants more wait until there's room.
+    // A limit of 0 means no limit, in which case it just keeps count.
+    class MemoryBudget
+    {
+    public:
+        MemoryBudget(uint64_t limit = 0);
+
+        // Waits until bytes fit under the limit. If nothing is in flight it goes through regardless, so a budget
+        // smaller than one frame slows things right down rather than stopping them.
+        void Acquire(uint64_t bytes);
+        void Release(uint64_t bytes);
+
+        uint64_t GetLimit() const { return limit_; }
+        uint64_t GetPeak() const;
+
+    protected:
+        uint64_t limit_;
+        uint64_t current_;
+        uint64_t peak_;
+        mutable std::mutex mutex_;
+        std::condition_variable released_;
+    };
+}
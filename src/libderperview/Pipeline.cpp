@@ -0,0 +1,453 @@
+#include "Pipeline.hpp"
+#include "Process.hpp"
+#include "ThreadPool.hpp"
+#include "ThreadTuner.hpp"
+#include "Progress.hpp"
+
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+using namespace DerperView;
+using namespace std;
+
+const int64_t Pipeline::WarmupFrames;
+const unsigned int Pipeline::AudioQueueDepth;
+const unsigned int Pipeline::BandMissLimit;
+
+FrameJob::FrameJob() :
+    sequence(0), bytes(0), input(av_frame_alloc()), output(av_frame_alloc()),
+    bandSource(nullptr), bandRowsReady(0), bandRowsTaken(0), bandRowsSubmitted(0), bandsPending(0), stretchNanoseconds(0), orphaned(false)
+{
+}
+
+FrameJob::~FrameJob()
+{
+    av_frame_free(&input);
+    av_frame_free(&output);
+}
+
+Pipeline::Pipeline(InputVideoFile& input, OutputVideoFile& output, Process& process, ThreadPool& pool, ThreadTuner *tuner, unsigned int queueDepth, unsigned int reorderWindow, ostream& outputStream, ProgressCounters *progress) :
+    input_(input), output_(output), process_(process), pool_(pool), tuner_(tuner),
+    outputStream_(outputStream), progress_(progress), cancel_(nullptr), encodeError_(0),
+    freeJobs_(queueDepth + 2), reorder_(max(1u, reorderWindow)), budget_(new MemoryBudget()), frameBytes_(0), splitFrames_(false),
+    audioStage_(false), freeAudioPackets_(AudioQueueDepth), audioQueue_(AudioQueueDepth),
+    bands_(false), bandJobLimit_(0), bandDeclined_(nullptr), bandSkips_(0), bandMisses_(0), bandFrameCount_(0), orphanCount_(0),
+    frameCount_(0), encodedPacketCount_(0), audioFrameCount_(0), warmedUp_({ 0, 0 }), finished_({ 0, 0 }),
+    decodeTime_(0), decodeWaitTime_(0), runTime_(0)
+{
+    // Enough jobs for queueDepth frames in between decoding and encoding, plus the one being decoded into and
+    // the one being encoded
+    for (unsigned int i = 0; i < queueDepth + 2; i++)
+    {
+        jobs_.emplace_back(new FrameJob());
+        freeJobs_.Push(jobs_.back().get());
+        AllocationCounter::Record(2 * sizeof(AVFrame)); // the FrameJob itself is counted by operator new
+    }
+}
+
+Pipeline::~Pipeline()
+{
+    for (auto packet : audioPackets_)
+        av_packet_free(&packet);
+}
+
+AllocationCounts Pipeline::GetSteadyStateAllocations() const
+{
+    AllocationCounts counts = { 0, 0 };
+    if (frameCount_ < WarmupFrames)
+        return counts;
+
+    counts.allocations = finished_.allocations - warmedUp_.allocations;
+    counts.bytes = finished_.bytes - warmedUp_.bytes;
+    return counts;
+}
+
+void Pipeline::SetMemoryBudget(uint64_t limit, uint64_t frameBytes)
+{
+    budget_.reset(new MemoryBudget(limit));
+    frameBytes_ = frameBytes;
+    splitFrames_ = limit != 0 && frameBytes != 0 && limit / frameBytes < pool_.GetThreadCount();
+}
+
+void Pipeline::EnableAudioStage()
+{
+    audioStage_ = true;
+    for (unsigned int i = 0; i < AudioQueueDepth; i++)
+    {
+        audioPackets_.push_back(av_packet_alloc());
+        freeAudioPackets_.Push(audioPackets_.back());
+    }
+    AllocationCounter::Record(AudioQueueDepth * sizeof(AVPacket));
+
+    // Called on the decode thread as packets are read. It only waits if the audio thread is a whole queue behind.
+    input_.SetAudioMode(AudioMode::Encode, [this](AVPacket *packet)
+    {
+        AVPacket *queued = nullptr;
+        if (!freeAudioPackets_.Pop(queued))
+            return;
+        av_packet_move_ref(queued, packet);
+        audioQueue_.Push(queued);
+    });
+}
+
+bool Pipeline::EnableBands()
+{
+    if (budget_->GetLimit() != 0 || jobs_.size() < 3)
+        return false;
+
+    bandJobLimit_ = static_cast<unsigned int>(jobs_.size()) - 2;
+    bandJobs_.reserve(bandJobLimit_);
+    bands_ = input_.SetBandHandler([this](const AVFrame *frame, int firstRow, int rowCount) { DrawBand(frame, firstRow, rowCount); });
+    return bands_;
+}
+
+int Pipeline::Run(const CancelToken& cancel)
+{
+    cancel_ = &cancel;
+    auto started = chrono::steady_clock::now();
+
+    thread audio;
+    if (audioStage_)
+        audio = thread(&Pipeline::AudioStage, this);
+
+    thread encoder(&Pipeline::EncodeStage, this);
+    DecodeStage();
+    audioQueue_.Close();
+    encoder.join();
+    if (audio.joinable())
+        audio.join();
+    runTime_ = chrono::steady_clock::now() - started;
+    finished_ = AllocationCounter::Get();
+    return encodeError_;
+}
+
+void Pipeline::DecodeStage()
+{
+    int64_t sequence = 0;
+    FrameJob *job = nullptr;
+
+    auto frame = DecodeNextFrame();
+    while (frame != nullptr && !IsStopping())
+    {
+        // Already on its way in bands, so it only wants the rest of its rows doing
+        FrameJob *banded = bands_ ? TakeBandJob(frame) : nullptr;
+        if (banded != nullptr)
+        {
+            banded->sequence = sequence++;
+            bandFrameCount_++;
+            if (progress_ != nullptr)
+                progress_->framesDecoded.fetch_add(1, memory_order_relaxed);
+            banded->bandRowsReady.store(static_cast<unsigned int>(banded->input->height), memory_order_release);
+            av_frame_unref(frame); // our reference from when it was drawn has the same buffers
+            SubmitBand(banded);
+            FinishBand(banded); // the decoder's given it out
+            frame = DecodeNextFrame();
+            continue;
+        }
+
+        // Waits here while the frames already on their way use up the budget, or every job is taken
+        auto waitStarted = chrono::steady_clock::now();
+        budget_->Acquire(frameBytes_);
+        bool gotJob = freeJobs_.Pop(job);
+        decodeWaitTime_ += chrono::steady_clock::now() - waitStarted;
+        if (!gotJob)
+            break;
+
+        job->bytes = frameBytes_;
+        av_frame_move_ref(job->input, frame);
+        if (output_.GetWritableVideoFrame(job->output) < 0)
+        {
+            av_frame_unref(job->input);
+            budget_->Release(job->bytes);
+            break;
+        }
+        job->sequence = sequence++;
+        if (progress_ != nullptr)
+            progress_->framesDecoded.fetch_add(1, memory_order_relaxed);
+
+        // Stretch that bad boy on the pool, then get in line for the encoder
+        pool_.Submit([this, job]()
+        {
+            if (IsStopping()) // It's not going to be encoded, don't bother
+            {
+                reorder_.Insert(job->sequence, job);
+                return;
+            }
+            auto started = chrono::steady_clock::now();
+            if (splitFrames_)
+                process_.DerpIt(job->input->data, job->input->linesize, job->output->data, job->output->linesize, pool_);
+            else
+                process_.DerpIt(job->input->data, job->input->linesize, job->output->data, job->output->linesize);
+            if (tuner_ != nullptr)
+                tuner_->StretchFinished(chrono::steady_clock::now() - started);
+            if (progress_ != nullptr)
+                progress_->framesStretched.fetch_add(1, memory_order_relaxed);
+            reorder_.Insert(job->sequence, job);
+        });
+
+        frame = DecodeNextFrame();
+    }
+
+    if (bands_)
+        StopBands();
+
+    // Everything numbered so far is still on its way, and that's all there'll be
+    reorder_.Close(sequence);
+}
+
+AVFrame *Pipeline::DecodeNextFrame()
+{
+    auto started = chrono::steady_clock::now();
+    AVFrame *frame = input_.GetNextFrame();
+    decodeTime_ += chrono::steady_clock::now() - started;
+    return frame;
+}
+
+void Pipeline::DrawBand(const AVFrame *frame, int firstRow, int rowCount)
+{
+    if (IsStopping())
+        return;
+
+    // Pictures are drawn one after the other, so a band from a different one means the last one's done
+    FrameJob *job = bandJobs_.empty() ? nullptr : bandJobs_.back();
+    if (job == nullptr || job->bandSource != frame->data[0])
+        job = StartBandJob(frame);
+    if (job == nullptr)
+        return;
+
+    // Everything above the band is final too. DerpRows wants bands to start on an even row.
+    unsigned int height = static_cast<unsigned int>(job->input->height);
+    unsigned int ready = min(height, static_cast<unsigned int>(max(0, firstRow + rowCount)));
+    if (ready < height)
+        ready &= ~1u;
+    if (ready <= job->bandRowsReady.load(memory_order_relaxed))
+        return;
+    job->bandRowsReady.store(ready, memory_order_release);
+
+    // Decoders draw a row of macroblocks at a time, which is too little to be worth a task of its own, so they
+    // go in GetBandHeight rows at a time. Whatever's left over is taken once the picture comes out.
+    if (ready < height && ready - job->bandRowsSubmitted < process_.GetBandHeight())
+        return;
+    job->bandRowsSubmitted = ready;
+    SubmitBand(job);
+}
+
+FrameJob *Pipeline::StartBandJob(const AVFrame *frame)
+{
+    // Rather than wait for a job, the picture gets stretched the usual way once it's decoded
+    FrameJob *job = nullptr;
+    if (bandJobs_.size() >= bandJobLimit_ || frame->buf[0] == nullptr || !freeJobs_.TryPop(job))
+    {
+        if (bandDeclined_ != frame->data[0])
+            bandSkips_++;
+        bandDeclined_ = frame->data[0];
+        return nullptr;
+    }
+
+    // Our own reference keeps the decoder's buffers around for the bands, even if it drops the picture
+    if (av_frame_ref(job->input, frame) < 0 || output_.GetWritableVideoFrame(job->output) < 0)
+    {
+        av_frame_unref(job->input);
+        av_frame_unref(job->output);
+        freeJobs_.Push(job);
+        return nullptr;
+    }
+
+    job->bytes = frameBytes_;
+    budget_->Acquire(job->bytes); // there's no limit with bands, so this only counts
+    job->bandSource = frame->data[0];
+    job->bandRowsReady = 0;
+    job->bandRowsTaken = 0;
+    job->bandRowsSubmitted = 0;
+    job->bandsPending = 1;
+    job->stretchNanoseconds = 0;
+    job->orphaned = false;
+    bandJobs_.push_back(job);
+    return job;
+}
+
+FrameJob *Pipeline::TakeBandJob(const AVFrame *frame)
+{
+    auto found = find_if(bandJobs_.begin(), bandJobs_.end(), [frame](FrameJob *job)
+    {
+        return job->bandSource == frame->data[0] && job->input->width == frame->width && job->input->height == frame->height;
+    });
+    if (found == bandJobs_.end())
+    {
+        // Either there was no job for it when it was drawn, or the decoder gives out something other than what
+        // it draws, like a cropped picture or one with film grain put on. If it's the second and that keeps
+        // happening, drawing is only wasting time.
+        if (bandSkips_ > 0)
+            bandSkips_--;
+        else if (!bandJobs_.empty() && ++bandMisses_ == BandMissLimit)
+        {
+            Locked(outputStream_) << "Decoded pictures don't match the bands drawn, stretching whole frames from here" << endl;
+            StopBands();
+        }
+        return nullptr;
+    }
+
+    // Anything drawn before it isn't going to come out now
+    FrameJob *job = *found;
+    for (auto i = bandJobs_.begin(); i != found; i++)
+        OrphanBandJob(*i);
+    bandJobs_.erase(bandJobs_.begin(), found + 1);
+    return job;
+}
+
+void Pipeline::SubmitBand(FrameJob *job)
+{
+    job->bandsPending.fetch_add(1, memory_order_relaxed);
+    pool_.Submit([this, job]()
+    {
+        // Takes whatever rows are ready that nobody else has, which is none if an earlier task got to them
+        unsigned int ready = job->bandRowsReady.load(memory_order_acquire);
+        unsigned int first = job->bandRowsTaken.load(memory_order_relaxed);
+        while (first < ready && !job->bandRowsTaken.compare_exchange_weak(first, ready, memory_order_relaxed))
+        {
+        }
+
+        if (first < ready && !IsStopping())
+        {
+            auto started = chrono::steady_clock::now();
+            process_.DerpRows(job->input->data, job->input->linesize, job->output->data, job->output->linesize, first, ready - first);
+            job->stretchNanoseconds.fetch_add((chrono::steady_clock::now() - started).count(), memory_order_relaxed);
+        }
+        FinishBand(job);
+    });
+}
+
+void Pipeline::FinishBand(FrameJob *job)
+{
+    if (job->bandsPending.fetch_sub(1, memory_order_acq_rel) != 1)
+        return;
+
+    // Last one out sends it on, or hands it back if it's not wanted
+    if (job->orphaned)
+    {
+        av_frame_unref(job->input);
+        av_frame_unref(job->output);
+        budget_->Release(job->bytes);
+        freeJobs_.Push(job);
+
+        lock_guard<mutex> lock(orphanMutex_);
+        if (--orphanCount_ == 0)
+            orphansFinished_.notify_all();
+        return;
+    }
+
+    if (tuner_ != nullptr)
+        tuner_->StretchFinished(chrono::nanoseconds(job->stretchNanoseconds.load(memory_order_relaxed)));
+    if (progress_ != nullptr)
+        progress_->framesStretched.fetch_add(1, memory_order_relaxed);
+    reorder_.Insert(job->sequence, job);
+}
+
+void Pipeline::OrphanBandJob(FrameJob *job)
+{
+    {
+        lock_guard<mutex> lock(orphanMutex_);
+        orphanCount_++;
+    }
+    job->orphaned = true;
+    FinishBand(job); // in place of the decoder giving it out
+}
+
+void Pipeline::StopBands()
+{
+    input_.SetBandHandler(nullptr);
+    bands_ = false;
+    for (auto job : bandJobs_)
+        OrphanBandJob(job);
+    bandJobs_.clear();
+
+    // The jobs have to be back before the pipeline can go
+    unique_lock<mutex> lock(orphanMutex_);
+    orphansFinished_.wait(lock, [this] { return orphanCount_ == 0; });
+}
+
+void Pipeline::EncodeStage()
+{
+    FrameJob *job = nullptr;
+    while (reorder_.Pop(job))
+    {
+        if (IsStopping()) // Hand the job straight back, so everything still on its way drains quickly
+        {
+            av_frame_unref(job->input);
+            av_frame_unref(job->output);
+        }
+        else
+        {
+            av_frame_unref(job->input);
+
+            // The encoder takes its own reference to the buffers, ours can go
+            job->output->pts = frameCount_;
+            auto started = chrono::steady_clock::now();
+            int packets = output_.WriteNextFrame(job->output);
+            if (packets < 0)
+                EncodeFailed(packets); // the rest only gets handed back
+            else
+                encodedPacketCount_ += packets;
+            if (tuner_ != nullptr)
+                tuner_->FrameEncoded(chrono::steady_clock::now() - started);
+            av_frame_unref(job->output);
+            frameCount_++;
+
+            if (frameCount_ == WarmupFrames)
+                warmedUp_ = AllocationCounter::Get();
+
+            if (progress_ != nullptr)
+                progress_->framesEncoded.fetch_add(1, memory_order_relaxed);
+        }
+
+        budget_->Release(job->bytes);
+        freeJobs_.Push(job);
+    }
+}
+
+void Pipeline::AudioStage()
+{
+    AVFrame *frame = av_frame_alloc();
+    AllocationCounter::Record(sizeof(AVFrame));
+
+    AVPacket *packet = nullptr;
+    while (audioQueue_.Pop(packet))
+    {
+        if (!IsStopping())
+            DecodeAudioPacket(packet, frame);
+        av_packet_unref(packet);
+        freeAudioPackets_.Push(packet);
+    }
+
+    // Get the last few frames out of the decoder. The encoder is flushed along with the video's at the end.
+    if (!IsStopping())
+        DecodeAudioPacket(nullptr, frame);
+    av_frame_free(&frame);
+}
+
+void Pipeline::DecodeAudioPacket(AVPacket *packet, AVFrame *frame)
+{
+    int result = input_.SendAudioPacket(packet);
+    if (result < 0 && result != AVERROR(EAGAIN))
+        return;
+
+    while (input_.ReceiveAudioFrame(frame) >= 0)
+    {
+        result = output_.WriteAudioFrame(frame);
+        av_frame_unref(frame);
+        if (result < 0)
+        {
+            EncodeFailed(result);
+            return;
+        }
+        audioFrameCount_++;
+    }
+}
+
+void Pipeline::EncodeFailed(int error)
+{
+    // Only the first one counts, anything after is likely just the same thing again
+    int expected = 0;
+    encodeError_.compare_exchange_strong(expected, error);
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include "BoundedQueue.hpp"
+#include "ReorderBuffer.hpp"
+#include "AllocationCounter.hpp"
+#include "MemoryBudget.hpp"
+#include "Video.hpp"
+#include "libderperview.hpp"
+
+#include <vector>
+#include <chrono>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+#include <cstdint>
+#include <algorithm>
+
+namespace DerperView
+{
+    class Process;
+    class ThreadPool;
+    class ThreadTuner;
+    struct ProgressCounters;
+
+    // One decoded frame on its way through the pipeline, along with somewhere to put its stretched version
+    struct FrameJob
+    {
+        FrameJob();
+        ~FrameJob();
+
+        int64_t sequence; // position in decode order
+        uint64_t bytes; // taken out of the memory budget for this frame
+        AVFrame *input; // holds a reference to the decoder's buffers
+        AVFrame *output; // buffers from the encoder's pool
+
+        // For a picture stretched in bands while it's still being decoded
+        const uint8_t *bandSource; // its first plane, to know it by when it comes out of the decoder
+        std::atomic<unsigned int> bandRowsReady; // rows above this are final
+        std::atomic<unsigned int> bandRowsTaken; // and the ones above this have been stretched, or are being
+        unsigned int bandRowsSubmitted; // the rows ready when the last task went in, decode thread only
+        std::atomic<int> bandsPending; // stretch tasks still to finish, plus one until the decoder gives it out
+        std::atomic<int64_t> stretchNanoseconds;
+        bool orphaned; // the decoder dropped it, so it goes straight back once its bands are done
+    };
+
+    // Runs a whole job as three stages going at once: demux and decode on the calling thread, the stretch on the
+    // thread pool and encode and mux on a thread of its own. Stretches finish in whatever order they finish, and
+    // a reorder buffer puts them back in decode order for the encoder. There are only so many jobs to go round,
+    // so a stage that gets ahead waits for the others to hand some back rather than buffering without limit.
+    class Pipeline
+    {
+    public:
+        // queueDepth is how many frames can be waiting between decoding and encoding. The stretches for all of
+        // them can be running at once, so it wants to be at least the pool's thread count. reorderWindow is how
+        // far ahead of the frame due at the encoder a finished stretch can get before its worker has to wait.
+        // If there's a tuner it's told how long stretches and encodes take, so it can resize the pool. Each
+        // stage adds the video frames it's done to progress, if there is one.
+        Pipeline(InputVideoFile& input, OutputVideoFile& output, Process& process, ThreadPool& pool, ThreadTuner *tuner, unsigned int queueDepth, unsigned int reorderWindow, std::ostream& outputStream, ProgressCounters *progress);
+        virtual ~Pipeline();
+
+        // Caps the bytes held by frames between decoding and encoding at limit (0 for no cap), with each video
+        // frame counted as frameBytes. The decoder waits rather than take another frame that would go over.
+        // If that leaves room for fewer frames than the pool has threads, each frame is stretched in bands
+        // across the pool instead, so the threads aren't left idle. Call it before Run.
+        void SetMemoryBudget(uint64_t limit, uint64_t frameBytes);
+
+        // Takes the audio off the decode thread and gives it a thread of its own, which decodes, resamples and
+        // encodes it while the video goes on without it. The two only meet at the muxer, which interleaves them.
+        // Call it before Run, and only when the audio is being re-encoded.
+        void EnableAudioStage();
+
+        // Stretches pictures in bands as the decoder finishes them, rather than waiting for the whole picture,
+        // so decoding and stretching a frame overlap. Only works with decoders that draw bands, and not with a
+        // memory budget, where a picture waiting on its bands could hold the room that the frame before it
+        // needs. Call it after SetMemoryBudget and before Run. Returns whether it's on.
+        bool EnableBands();
+
+        // Returns once every frame read has been encoded. If cancel is set, decoding stops at the next frame and
+        // anything not encoded by then is dropped rather than encoded. The same happens if encoding or writing
+        // fails, and the first error is returned, otherwise 0.
+        int Run(const CancelToken& cancel);
+
+        int64_t GetFrameCount() const { return frameCount_; }
+        int64_t GetEncodedPacketCount() const { return encodedPacketCount_; }
+        int64_t GetAudioFrameCount() const { return audioFrameCount_; }
+        int64_t GetBandFrameCount() const { return bandFrameCount_; }
+        ReorderStats GetReorderStats() const { return reorder_.GetStats(); }
+        uint64_t GetPeakInFlightBytes() const { return budget_->GetPeak(); }
+
+        // Where the decode thread's time went: reading and decoding (audio packets read along the way included),
+        // and waiting for the stretch and encoder to hand jobs or budget back. If it spent most of the run
+        // decoding, the decoder's what's holding things up.
+        std::chrono::nanoseconds GetDecodeTime() const { return decodeTime_; }
+        std::chrono::nanoseconds GetDecodeWaitTime() const { return decodeWaitTime_; }
+        std::chrono::nanoseconds GetRunTime() const { return runTime_; }
+
+        // Allocations made from when the first WarmupFrames frames had been encoded until Run returned, and how
+        // many frames were encoded in that time. By then every pool and queue has reached its working size, so
+        // this should be zero.
+        AllocationCounts GetSteadyStateAllocations() const;
+        int64_t GetSteadyStateFrameCount() const { return std::max<int64_t>(0, frameCount_ - WarmupFrames); }
+
+        static const int64_t WarmupFrames = 100;
+        static const unsigned int AudioQueueDepth = 64; // packets read but not yet decoded, before demuxing waits
+        static const unsigned int BandMissLimit = 8; // pictures that come out unlike the ones drawn, before bands are given up on
+
+    protected:
+        void DecodeStage();
+        AVFrame *DecodeNextFrame();
+        bool IsStopping() const { return cancel_->IsCancelled() || encodeError_.load(std::memory_order_relaxed) < 0; }
+        void EncodeFailed(int error);
+        void EncodeStage();
+        void AudioStage();
+        void DecodeAudioPacket(AVPacket *packet, AVFrame *frame);
+
+        void DrawBand(const AVFrame *frame, int firstRow, int rowCount);
+        FrameJob *StartBandJob(const AVFrame *frame);
+        FrameJob *TakeBandJob(const AVFrame *frame);
+        void SubmitBand(FrameJob *job);
+        void FinishBand(FrameJob *job);
+        void OrphanBandJob(FrameJob *job);
+        void StopBands();
+
+        InputVideoFile& input_;
+        OutputVideoFile& output_;
+        Process& process_;
+        ThreadPool& pool_;
+        ThreadTuner *tuner_;
+        std::ostream& outputStream_;
+        ProgressCounters *progress_;
+        const CancelToken *cancel_;
+        std::atomic<int> encodeError_; // the first thing that went wrong encoding or writing
+
+        std::vector<std::unique_ptr<FrameJob>> jobs_;
+        BoundedQueue<FrameJob *> freeJobs_;
+        ReorderBuffer<FrameJob *> reorder_;
+        std::unique_ptr<MemoryBudget> budget_;
+        uint64_t frameBytes_;
+        bool splitFrames_; // stretch each frame across the pool, as there aren't enough of them to go round
+
+        bool audioStage_;
+        std::vector<AVPacket *> audioPackets_;
+        BoundedQueue<AVPacket *> freeAudioPackets_;
+        BoundedQueue<AVPacket *> audioQueue_;
+
+        bool bands_;
+        std::vector<FrameJob *> bandJobs_; // pictures being stretched in bands, in the order they'll come out
+        unsigned int bandJobLimit_; // leaves jobs over for frames that weren't drawn, so they can't be held up by later ones
+        const uint8_t *bandDeclined_; // the last picture there was no job for
+        unsigned int bandSkips_; // pictures there was no job for that haven't come out yet
+        unsigned int bandMisses_;
+        int64_t bandFrameCount_;
+        std::mutex orphanMutex_;
+        std::condition_variable orphansFinished_;
+        unsigned int orphanCount_;
+
+        int64_t frameCount_;
+        int64_t encodedPacketCount_;
+        int64_t audioFrameCount_;
+        AllocationCounts warmedUp_; // the count once warm up was over
+        AllocationCounts finished_; // and when Run was done
+        std::chrono::nanoseconds decodeTime_;
+        std::chrono::nanoseconds decodeWaitTime_;
+        std::chrono::nanoseconds runTime_;
+    };
+}
@@ -1,88 +1,316 @@
 #include "Process.hpp"
+#include "ThreadPool.hpp"
+#include "libderperview.hpp"
 #include <cmath>
+#include <cstddef>
 #include <iostream>
 #include <vector>
 #include <algorithm>
 #include <unordered_map>
 
+#if defined(DERPERVIEW_X86) && defined(_MSC_VER)
+    #include <intrin.h>
+#endif
+
 using namespace std;
 using namespace DerperView;
 
-template <typename T>
-T Lerp(T a, T b, double t)
-{
-    double ax = static_cast<double>(a);
-    double bx = static_cast<double>(b);
-    double result = ax + t * (bx - ax);
-    return static_cast<T>(result);
-}
+static unsigned int GetL2CacheSize();
 
-Process::Process(unsigned int width, unsigned int height) : sourceWidth_(width), targetWidth_(0), height_(height)
+Process::Process(unsigned int width, unsigned int height, unsigned int sampleSize, unsigned int chromaShiftX, unsigned int chromaShiftY) :
+    sourceWidth_(width), targetWidth_(0), height_(height),
+    sampleSize_(sampleSize), chromaShiftX_(chromaShiftX), chromaShiftY_(chromaShiftY),
+    bandHeight_(height), cancel_(nullptr)
 {
     targetWidth_ = GetDerpedWidth(sourceWidth_);
 
     // Generate lookup table
-    lookup_ = vector<float>(targetWidth_);
+    vector<float> lookup(targetWidth_);
     for (int tx = 0; tx < targetWidth_; tx++)
     {
         float x = (static_cast<float>(tx) / targetWidth_ - 0.5f) * 2; //  - 1 -> 1
         float sx = tx - static_cast<int>(targetWidth_ - width) / 2;
         float offset = static_cast<float>(pow(x, 2)) * (x < 0 ? -1 : 1) * ((targetWidth_ - width) / 2);
-        lookup_[tx] = sx - offset;
+        lookup[tx] = sx - offset;
+    }
+
+    BuildGatherTable(luma_, lookup, false);
+    BuildGatherTable(chroma_, lookup, true);
+
+    // Size bands so that a band's input and output rows, both luma and chroma, take up about half of
+    // L2. The rest is left for the gather tables and whatever else the core is up to.
+    const unsigned int rowPairBytes = (2 * (luma_.sourceWidth + luma_.targetWidth) + (2 >> chromaShiftY_) * 2 * (chroma_.sourceWidth + chroma_.targetWidth)) * sampleSize_;
+    bandHeight_ = max(1u, GetL2CacheSize() / 2 / max(1u, rowPairBytes)) * 2;
+}
+
+void Process::BuildGatherTable(GatherTable& table, const vector<float>& lookup, bool chroma)
+{
+    table.chroma = chroma;
+    const bool halfWidth = chroma && chromaShiftX_ > 0;
+    table.sourceWidth = halfWidth ? (sourceWidth_ + 1) / 2 : sourceWidth_;
+    table.targetWidth = halfWidth ? targetWidth_ / 2 : targetWidth_;
+    table.index0 = vector<int>(table.targetWidth);
+    table.index1 = vector<int>(table.targetWidth);
+    table.weight = vector<int16_t>((table.targetWidth + 31) / 32 * 32, 0);
+
+    // Subsampled chroma samples at the odd luma column's position, with the integer part halved and
+    // the fractional part left as it is.
+    for (unsigned int x = 0; x < table.targetWidth; x++)
+    {
+        auto value = lookup[halfWidth ? x * 2 + 1 : x];
+        auto a0 = floor(value);
+        auto a1 = min(ceil(value), static_cast<float>(sourceWidth_ - 1));
+        int index0 = static_cast<int>(a0);
+        int index1 = static_cast<int>(a1);
+        if (halfWidth)
+        {
+            index0 /= 2;
+            index1 /= 2;
+        }
+
+        int weight = static_cast<int>(lround((value - a0) * 32768.0));
+        if (index0 == index1)
+            weight = 0;
+        else if (weight >= 32768) // Doesn't fit in Q15, but that's just the second pixel
+        {
+            index0 = index1;
+            weight = 0;
+        }
+
+        table.index0[x] = index0;
+        table.index1[x] = index1;
+        table.weight[x] = static_cast<int16_t>(weight);
+    }
+}
+
+// On x86 only the formats the vector kernels don't cover get here, elsewhere all of them do
+template <typename Format>
+static unique_ptr<Process> CreateCpuProcess(unsigned int width, unsigned int height)
+{
+    // The sizes that most cameras shoot 4:3 at
+    switch (width)
+    {
+    case 1440:
+        return make_unique<CpuProcess<Format, 1440>>(width, height);
+    case 1920:
+        return make_unique<CpuProcess<Format, 1920>>(width, height);
+    case 2704:
+        return make_unique<CpuProcess<Format, 2704>>(width, height);
+    case 4000:
+        return make_unique<CpuProcess<Format, 4000>>(width, height);
+    default:
+        return make_unique<CpuProcess<Format>>(width, height);
+    }
+}
+
+template <typename Format>
+static unique_ptr<Process> CreateSimdOrCpuProcess(unsigned int width, unsigned int height)
+{
+#ifdef DERPERVIEW_X86
+    if (Avx2Process::IsSupported())
+        return make_unique<Avx2Process>(width, height, Format::ChromaShiftX, Format::ChromaShiftY);
+    if (Sse41Process::IsSupported())
+        return make_unique<Sse41Process>(width, height, Format::ChromaShiftX, Format::ChromaShiftY);
+
+    // Only a CPU from before SSE4.1 gets this far, which isn't worth a kernel for each width on top
+    return make_unique<CpuProcess<Format>>(width, height);
+#else
+    return CreateCpuProcess<Format>(width, height);
+#endif
+}
+
+unique_ptr<Process> Process::Create(AVPixelFormat format, unsigned int width, unsigned int height)
+{
+    switch (format)
+    {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+        return CreateSimdOrCpuProcess<Yuv420p>(width, height);
+    case AV_PIX_FMT_YUV422P:
+    case AV_PIX_FMT_YUVJ422P:
+        return CreateSimdOrCpuProcess<Yuv422p>(width, height);
+    case AV_PIX_FMT_YUV444P:
+    case AV_PIX_FMT_YUVJ444P:
+        return CreateSimdOrCpuProcess<Yuv444p>(width, height);
+    case AV_PIX_FMT_YUV420P10:
+        return CreateCpuProcess<Yuv420p10>(width, height);
+    default:
+        return nullptr;
+    }
+}
+
+int Process::DerpIt(const uint8_t *const inData[], const int inLinesize[], uint8_t *const outData[], const int outLinesize[])
+{
+    DerpRows(inData, inLinesize, outData, outLinesize, 0, height_);
+    return targetWidth_;
+}
+
+int Process::DerpIt(const uint8_t *const inData[], const int inLinesize[], uint8_t *const outData[], const int outLinesize[], ThreadPool& pool)
+{
+    const unsigned int bandCount = (height_ + bandHeight_ - 1) / bandHeight_;
+    pool.ParallelFor(bandCount, [&](unsigned int band)
+    {
+        const unsigned int firstRow = band * bandHeight_;
+        DerpRows(inData, inLinesize, outData, outLinesize, firstRow, min(bandHeight_, height_ - firstRow));
+    });
+    return targetWidth_;
+}
+
+void Process::DerpRows(const uint8_t *const inData[], const int inLinesize[], uint8_t *const outData[], const int outLinesize[], unsigned int firstRow, unsigned int rowCount)
+{
+    for (unsigned int y = firstRow; y < firstRow + rowCount; y++)
+    {
+        if (cancel_ != nullptr && cancel_->IsCancelled())
+            return;
+        DerpRow(luma_, inData[0] + static_cast<ptrdiff_t>(y) * inLinesize[0], outData[0] + static_cast<ptrdiff_t>(y) * outLinesize[0]);
+    }
+
+    // With vertical subsampling chroma row n goes with luma rows 2n and 2n + 1
+    const unsigned int firstChromaRow = firstRow >> chromaShiftY_;
+    const unsigned int endChromaRow = (firstRow + rowCount + (1 << chromaShiftY_) - 1) >> chromaShiftY_;
+    for (unsigned int y = firstChromaRow; y < endChromaRow; y++)
+    {
+        if (cancel_ != nullptr && cancel_->IsCancelled())
+            return;
+        for (int plane = 1; plane < 3; plane++)
+            DerpRow(chroma_, inData[plane] + static_cast<ptrdiff_t>(y) * inLinesize[plane], outData[plane] + static_cast<ptrdiff_t>(y) * outLinesize[plane]);
+    }
+}
+
+#ifndef DERPERVIEW_X86
+static unsigned int GetL2CacheSize()
+{
+    return 256 * 1024;
+}
+#endif
+
+#ifdef DERPERVIEW_X86
+
+static void CpuId(unsigned int leaf, unsigned int subLeaf, unsigned int registers[4])
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuidex(info, static_cast<int>(leaf), static_cast<int>(subLeaf));
+    for (int i = 0; i < 4; i++)
+        registers[i] = static_cast<unsigned int>(info[i]);
+#else
+    unsigned int eax, ebx, ecx, edx;
+    __asm__ __volatile__("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(leaf), "c"(subLeaf));
+    registers[0] = eax;
+    registers[1] = ebx;
+    registers[2] = ecx;
+    registers[3] = edx;
+#endif
+}
+
+static bool OsSavesAvxState()
+{
+    unsigned int registers[4];
+    CpuId(1, 0, registers);
+    bool osxsave = (registers[2] & (1u << 27)) != 0;
+    bool avx = (registers[2] & (1u << 28)) != 0;
+    if (!osxsave || !avx)
+        return false;
+
+#ifdef _MSC_VER
+    unsigned long long xcr0 = _xgetbv(0);
+#else
+    unsigned int xcr0Low, xcr0High;
+    __asm__ __volatile__("xgetbv" : "=a"(xcr0Low), "=d"(xcr0High) : "c"(0));
+    unsigned long long xcr0 = (static_cast<unsigned long long>(xcr0High) << 32) | xcr0Low;
+#endif
+    return (xcr0 & 0x6) == 0x6; // XMM and YMM state
+}
+
+static unsigned int GetL2CacheSize()
+{
+    // Extended leaf 0x80000006 has the L2 size in KB in ECX[31:16], on both Intel and AMD
+    unsigned int registers[4];
+    CpuId(0x80000000, 0, registers);
+    if (registers[0] >= 0x80000006)
+    {
+        CpuId(0x80000006, 0, registers);
+        unsigned int kilobytes = registers[2] >> 16;
+        if (kilobytes > 0)
+            return kilobytes * 1024;
     }
+    return 256 * 1024;
+}
+
+bool Sse41Process::IsSupported()
+{
+    unsigned int registers[4];
+    CpuId(1, 0, registers);
+    return (registers[2] & (1u << 19)) != 0;
+}
+
+bool Avx2Process::IsSupported()
+{
+    unsigned int registers[4];
+    CpuId(0, 0, registers);
+    if (registers[0] < 7)
+        return false;
+    CpuId(7, 0, registers);
+    return (registers[1] & (1u << 5)) != 0 && OsSavesAvxState();
 }
 
-int Process::GetDerpedWidth(int sourceWidth)
+SimdProcess::SimdProcess(unsigned int width, unsigned int height, unsigned int chromaShiftX, unsigned int chromaShiftY) :
+    Process(width, height, 1, chromaShiftX, chromaShiftY)
 {
-    int targetWidth = sourceWidth * 4 / 3;
-    if (targetWidth % 2 == 1) // Since x264 won't encode video with an odd number of pixels in a row
-        targetWidth -= 1;
-    return targetWidth;
+    BuildShuffleTable(lumaShuffle_, luma_);
+    BuildShuffleTable(chromaShuffle_, chroma_);
 }
 
-int CpuProcess::DerpIt(vector<unsigned char> &inData, vector<unsigned char> &outData)
+void SimdProcess::BuildShuffleTable(ShuffleTable& shuffleTable, const GatherTable& table)
 {
-    const int uOffsetSource = height_ * sourceWidth_;
-    const int vOffsetSource = static_cast<int>(height_ * sourceWidth_ * 1.25);
-    const int uOffsetTarget = height_ * targetWidth_;
-    const int vOffsetTarget = static_cast<int>(height_ * targetWidth_ * 1.25);
+    const unsigned int blockCount = (table.targetWidth + BlockWidth - 1) / BlockWidth;
+    shuffleTable.blockBase = vector<int>(blockCount, -1);
+    shuffleTable.shuffle = vector<uint8_t>(blockCount * 4 * 16, 0x80);
 
-    for (unsigned int y = 0; y < height_; y ++)
+    for (unsigned int block = 0; block < blockCount; block++)
     {
-        for (unsigned int x = 0; x < targetWidth_; x++)
+        unsigned int firstX = block * BlockWidth;
+        if (firstX + BlockWidth > table.targetWidth)
+            continue; // Partial block, would write past the end of the row
+
+        int base = table.index0[firstX];
+        for (int i = 0; i < BlockWidth; i++)
+            base = min(base, table.index0[firstX + i]);
+        if (base + WindowWidth > static_cast<int>(table.sourceWidth))
+            continue;
+
+        bool fits = true;
+        uint8_t *masks = &shuffleTable.shuffle[block * 4 * 16];
+        for (int i = 0; i < BlockWidth; i++)
         {
-            auto value = lookup_[x];
-            auto a0 = floor(value);
-            auto a1 = min(ceil(value), static_cast<float>(sourceWidth_ - 1));
-            auto offset0 = static_cast<int>(a0);
-            auto offset1 = static_cast<int>(a1);
-
-            unsigned char y0 = inData[(y * sourceWidth_ + offset0)];
-            unsigned char y1 = inData[(y * sourceWidth_ + offset1)];
-            unsigned char yout = Lerp(y0, y1, value - a0);
-            outData[(y * targetWidth_ + x)] = yout;
-
-            if (y % 2 == 0 && x % 2 == 0)
+            int relative0 = table.index0[firstX + i] - base;
+            int relative1 = table.index1[firstX + i] - base;
+            if (relative0 >= WindowWidth || relative1 >= WindowWidth)
             {
-                auto uvValue = lookup_[x + 1];
-                auto uva0 = floor(uvValue);
-                auto uva1 = min(ceil(uvValue), static_cast<float>(sourceWidth_ - 1));
-                auto uvOffset0 = static_cast<int>(uva0);
-                auto uvOffset1 = static_cast<int>(uva1);
-
-                unsigned char u0 = inData[uOffsetSource + (y * sourceWidth_ / 4 + uvOffset0 / 2)];
-                unsigned char u1 = inData[uOffsetSource + (y * sourceWidth_ / 4 + uvOffset1 / 2)];
-                unsigned char v0 = inData[vOffsetSource + (y * sourceWidth_ / 4 + uvOffset0 / 2)];
-                unsigned char v1 = inData[vOffsetSource + (y * sourceWidth_ / 4 + uvOffset1 / 2)];
-
-                unsigned char uout = Lerp(u0, u1, uvValue - uva0);
-                unsigned char vout = Lerp(v0, v1, uvValue - uva0);
-
-                outData[uOffsetTarget + (y * targetWidth_ / 4 + x / 2)] = uout;
-                outData[vOffsetTarget + (y * targetWidth_ / 4 + x / 2)] = vout;
+                fits = false;
+                break;
             }
+            masks[i] = relative0 < 16 ? static_cast<uint8_t>(relative0) : 0x80;
+            masks[16 + i] = relative0 >= 16 ? static_cast<uint8_t>(relative0 - 16) : 0x80;
+            masks[32 + i] = relative1 < 16 ? static_cast<uint8_t>(relative1) : 0x80;
+            masks[48 + i] = relative1 >= 16 ? static_cast<uint8_t>(relative1 - 16) : 0x80;
         }
+        if (fits)
+            shuffleTable.blockBase[block] = base;
     }
+}
 
-    return targetWidth_;
+void SimdProcess::DerpRowScalarBlocks(const GatherTable& table, const ShuffleTable& shuffleTable, const unsigned char *in, unsigned char *out)
+{
+    const unsigned int blockCount = static_cast<unsigned int>(shuffleTable.blockBase.size());
+    for (unsigned int block = 0; block < blockCount; block++)
+    {
+        if (shuffleTable.blockBase[block] < 0)
+        {
+            const unsigned int x = block * BlockWidth;
+            DerpRowScalar<uint8_t>(table, in, out, x, min(x + BlockWidth, table.targetWidth));
+        }
+    }
 }
+
+#endif
@@ -1,31 +1,216 @@
 #pragma once
 
+extern "C"
+{
+    #include "libavutil/pixfmt.h"
+}
+
 #include <vector>
+#include <memory>
+#include <string>
+#include <cstdint>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+    #define DERPERVIEW_X86
+#endif
 
 namespace DerperView
 {
+    class ThreadPool;
+    class CancelToken;
+
+    // Compile time description of a planar YUV format
+    template <typename SampleType, unsigned int ChromaShiftXValue, unsigned int ChromaShiftYValue, unsigned int BitDepthValue>
+    struct PlanarFormat
+    {
+        typedef SampleType Sample;
+        static const unsigned int ChromaShiftX = ChromaShiftXValue;
+        static const unsigned int ChromaShiftY = ChromaShiftYValue;
+        static const unsigned int BitDepth = BitDepthValue;
+    };
+
+    template <typename SampleType, unsigned int ChromaShiftXValue, unsigned int ChromaShiftYValue, unsigned int BitDepthValue>
+    const unsigned int PlanarFormat<SampleType, ChromaShiftXValue, ChromaShiftYValue, BitDepthValue>::ChromaShiftX;
+    template <typename SampleType, unsigned int ChromaShiftXValue, unsigned int ChromaShiftYValue, unsigned int BitDepthValue>
+    const unsigned int PlanarFormat<SampleType, ChromaShiftXValue, ChromaShiftYValue, BitDepthValue>::ChromaShiftY;
+    template <typename SampleType, unsigned int ChromaShiftXValue, unsigned int ChromaShiftYValue, unsigned int BitDepthValue>
+    const unsigned int PlanarFormat<SampleType, ChromaShiftXValue, ChromaShiftYValue, BitDepthValue>::BitDepth;
+
+    struct Yuv420p : PlanarFormat<uint8_t, 1, 1, 8> { static const char *Name() { return "yuv420p"; } };
+    struct Yuv422p : PlanarFormat<uint8_t, 1, 0, 8> { static const char *Name() { return "yuv422p"; } };
+    struct Yuv444p : PlanarFormat<uint8_t, 0, 0, 8> { static const char *Name() { return "yuv444p"; } };
+    struct Yuv420p10 : PlanarFormat<uint16_t, 1, 1, 10> { static const char *Name() { return "yuv420p10"; } };
+
     class Process
     {
     public:
-        Process(unsigned int width, unsigned int height);
+        Process(unsigned int width, unsigned int height, unsigned int sampleSize, unsigned int chromaShiftX, unsigned int chromaShiftY);
 
         virtual ~Process() { };
 
-        virtual int DerpIt(std::vector<unsigned char>& inData, std::vector<unsigned char>& outData) = 0;
-        static int GetDerpedWidth(int sourceWidth);
+        // Planes are passed the same way as AVFrame's data and linesize, so frames from libav can be read and
+        // written where they are, whatever padding they have.
+        int DerpIt(const uint8_t *const inData[], const int inLinesize[], uint8_t *const outData[], const int outLinesize[]);
+
+        // Same as DerpIt, but the frame is split into bands of GetBandHeight() rows that are spread across the pool
+        int DerpIt(const uint8_t *const inData[], const int inLinesize[], uint8_t *const outData[], const int outLinesize[], ThreadPool& pool);
+
+        // Stretches luma rows [firstRow, firstRow + rowCount) and the chroma rows that go with them. firstRow
+        // must be even so that no two bands share a chroma row.
+        void DerpRows(const uint8_t *const inData[], const int inLinesize[], uint8_t *const outData[], const int outLinesize[], unsigned int firstRow, unsigned int rowCount);
+
+        // Rows in a band whose input and output fit in about half of L2, always even
+        unsigned int GetBandHeight() const { return bandHeight_; }
+
+        // Once cancel is set, DerpRows gives up at the next row and leaves the rest of the frame as it was
+        void SetCancelToken(const CancelToken *cancel) { cancel_ = cancel; }
+        virtual std::string GetName() const = 0;
+
+        static constexpr int GetDerpedWidth(int sourceWidth)
+        {
+            int targetWidth = sourceWidth * 4 / 3;
+            if (targetWidth % 2 == 1) // Since x264 won't encode video with an odd number of pixels in a row
+                targetWidth -= 1;
+            return targetWidth;
+        }
+
+        // Picks the fastest implementation for the format that the current CPU can run, or nullptr if the
+        // format isn't supported
+        static std::unique_ptr<Process> Create(AVPixelFormat format, unsigned int width, unsigned int height);
 
     protected:
+        // Where each output column of a plane comes from: two source columns, and a Q15 weight for the
+        // second one. Worked out once here so the per-frame work is integer multiply-adds only.
+        struct GatherTable
+        {
+            bool chroma;
+            unsigned int sourceWidth;
+            unsigned int targetWidth;
+            std::vector<int> index0;
+            std::vector<int> index1;
+            std::vector<int16_t> weight; // padded with zeros to a multiple of 32 for the vector kernels
+        };
+
+        void BuildGatherTable(GatherTable& table, const std::vector<float>& lookup, bool chroma);
+        virtual void DerpRow(const GatherTable& table, const unsigned char *in, unsigned char *out) = 0;
+
+        // p0 + round((p1 - p0) * weight / 32768), for output columns [fromX, toX)
+        template <typename Sample>
+        static inline void DerpRowScalar(const GatherTable& table, const unsigned char *in, unsigned char *out, unsigned int fromX, unsigned int toX)
+        {
+            const Sample *source = reinterpret_cast<const Sample *>(in);
+            Sample *target = reinterpret_cast<Sample *>(out);
+            const int *index0 = table.index0.data();
+            const int *index1 = table.index1.data();
+            const int16_t *weight = table.weight.data();
+
+            for (unsigned int x = fromX; x < toX; x++)
+            {
+                int p0 = source[index0[x]];
+                int p1 = source[index1[x]];
+                target[x] = static_cast<Sample>(p0 + (((p1 - p0) * weight[x] + 16384) >> 15));
+            }
+        }
+
         unsigned int sourceWidth_;
         unsigned int targetWidth_;
         unsigned int height_;
-        std::vector<float> lookup_;
+        unsigned int sampleSize_;
+        unsigned int chromaShiftX_;
+        unsigned int chromaShiftY_;
+        unsigned int bandHeight_;
+        const CancelToken *cancel_;
+        GatherTable luma_;
+        GatherTable chroma_;
     };
-    
+
+    // Plain C++ implementation for any of the formats above. If Width is given it has to be the source width,
+    // and it lets the compiler see the trip count of the row loop so it can unroll and vectorise it.
+    template <typename Format, unsigned int Width = 0>
     class CpuProcess : public Process
     {
     public:
-        CpuProcess(unsigned int width, unsigned int height) : Process(width, height) { }
+        typedef typename Format::Sample Sample;
+        static const unsigned int TargetWidth = Width == 0 ? 0 : GetDerpedWidth(Width);
+        static const unsigned int ChromaTargetWidth = TargetWidth >> Format::ChromaShiftX;
 
-        virtual int DerpIt(std::vector<unsigned char>& inData, std::vector<unsigned char>& outData) override;
+        CpuProcess(unsigned int width, unsigned int height) :
+            Process(width, height, sizeof(Sample), Format::ChromaShiftX, Format::ChromaShiftY) { }
+
+        virtual std::string GetName() const override
+        {
+            std::string name = std::string("scalar ") + Format::Name();
+            if (Width != 0)
+                name += ", " + std::to_string(Width) + " wide";
+            return name;
+        }
+
+    protected:
+        virtual void DerpRow(const GatherTable& table, const unsigned char *in, unsigned char *out) override
+        {
+            if (Width == 0)
+                DerpRowScalar<Sample>(table, in, out, 0, table.targetWidth);
+            else if (table.chroma)
+                DerpRowScalar<Sample>(table, in, out, 0, ChromaTargetWidth);
+            else
+                DerpRowScalar<Sample>(table, in, out, 0, TargetWidth);
+        }
+    };
+
+#ifdef DERPERVIEW_X86
+    // Base for the vectorised implementations, which work on any of the 8 bit formats.
+    //
+    // Output columns are handled in blocks of 16. Each block reads a 32 byte window of the source row
+    // starting at a per-block base column, and picks its two source pixels per output out of that window
+    // with byte shuffles. The blend is the same Q15 multiply-add as CpuProcess, so the output matches it
+    // bit for bit. Blocks whose window would run off the end of the row are done by the scalar path.
+    class SimdProcess : public Process
+    {
+    public:
+        SimdProcess(unsigned int width, unsigned int height, unsigned int chromaShiftX, unsigned int chromaShiftY);
+
+        static const int BlockWidth = 16;
+        static const int WindowWidth = 32;
+
+    protected:
+        struct ShuffleTable
+        {
+            std::vector<int> blockBase; // -1 if the block has to be done by the scalar path
+            std::vector<uint8_t> shuffle; // 4 masks of 16 bytes per block: index0 low/high half, index1 low/high half
+        };
+
+        void BuildShuffleTable(ShuffleTable& shuffleTable, const GatherTable& table);
+        const ShuffleTable& GetShuffleTable(const GatherTable& table) const { return table.chroma ? chromaShuffle_ : lumaShuffle_; }
+        static void DerpRowScalarBlocks(const GatherTable& table, const ShuffleTable& shuffleTable, const unsigned char *in, unsigned char *out);
+
+        ShuffleTable lumaShuffle_;
+        ShuffleTable chromaShuffle_;
+    };
+
+    class Sse41Process : public SimdProcess
+    {
+    public:
+        Sse41Process(unsigned int width, unsigned int height, unsigned int chromaShiftX, unsigned int chromaShiftY) :
+            SimdProcess(width, height, chromaShiftX, chromaShiftY) { }
+
+        virtual std::string GetName() const override { return "SSE4.1"; }
+        static bool IsSupported();
+
+    protected:
+        virtual void DerpRow(const GatherTable& table, const unsigned char *in, unsigned char *out) override;
+    };
+
+    class Avx2Process : public SimdProcess
+    {
+    public:
+        Avx2Process(unsigned int width, unsigned int height, unsigned int chromaShiftX, unsigned int chromaShiftY) :
+            SimdProcess(width, height, chromaShiftX, chromaShiftY) { }
+
+        virtual std::string GetName() const override { return "AVX2"; }
+        static bool IsSupported();
+
+    protected:
+        virtual void DerpRow(const GatherTable& table, const unsigned char *in, unsigned char *out) override;
     };
+#endif
 }
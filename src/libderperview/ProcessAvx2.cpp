@@ -0,0 +1,111 @@
+#include "Process.hpp"
+
+#ifdef DERPERVIEW_X86
+
+#include <immintrin.h>
+
+// See ProcessSse41.cpp for why this is an attribute and not a compiler flag
+#if defined(__GNUC__) || defined(__clang__)
+    #define DERPERVIEW_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+    #define DERPERVIEW_TARGET_AVX2
+#endif
+
+using namespace std;
+using namespace DerperView;
+
+DERPERVIEW_TARGET_AVX2
+static inline __m256i Load2(const void *low, const void *high)
+{
+    return _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(low))),
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(high)), 1);
+}
+
+// Two neighbouring blocks at once, one per 128 bit lane. Shuffles and unpacks work within a lane, so
+// the weights get rearranged to match the unpacked pixel order rather than the pixels being put back in order.
+DERPERVIEW_TARGET_AVX2
+static inline __m256i Blend32(const unsigned char *windowA, const unsigned char *windowB, const uint8_t *masksA, const uint8_t *masksB, const int16_t *weight)
+{
+    const __m256i low = Load2(windowA, windowB);
+    const __m256i high = Load2(windowA + 16, windowB + 16);
+
+    const __m256i p0 = _mm256_or_si256(
+        _mm256_shuffle_epi8(low, Load2(masksA, masksB)),
+        _mm256_shuffle_epi8(high, Load2(masksA + 16, masksB + 16)));
+    const __m256i p1 = _mm256_or_si256(
+        _mm256_shuffle_epi8(low, Load2(masksA + 32, masksB + 32)),
+        _mm256_shuffle_epi8(high, Load2(masksA + 48, masksB + 48)));
+
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i p0Low = _mm256_unpacklo_epi8(p0, zero); // columns 0-7, 16-23
+    const __m256i p0High = _mm256_unpackhi_epi8(p0, zero); // columns 8-15, 24-31
+    const __m256i p1Low = _mm256_unpacklo_epi8(p1, zero);
+    const __m256i p1High = _mm256_unpackhi_epi8(p1, zero);
+
+    const __m256i weightA = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(weight));
+    const __m256i weightB = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(weight + 16));
+    const __m256i weightLow = _mm256_permute2x128_si256(weightA, weightB, 0x20);
+    const __m256i weightHigh = _mm256_permute2x128_si256(weightA, weightB, 0x31);
+
+    const __m256i outLow = _mm256_add_epi16(p0Low, _mm256_mulhrs_epi16(_mm256_sub_epi16(p1Low, p0Low), weightLow));
+    const __m256i outHigh = _mm256_add_epi16(p0High, _mm256_mulhrs_epi16(_mm256_sub_epi16(p1High, p0High), weightHigh));
+
+    return _mm256_packus_epi16(outLow, outHigh);
+}
+
+DERPERVIEW_TARGET_AVX2
+static inline __m128i Blend16(const unsigned char *window, const uint8_t *masks, const int16_t *weight)
+{
+    const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i *>(window));
+    const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i *>(window + 16));
+
+    const __m128i p0 = _mm_or_si128(
+        _mm_shuffle_epi8(low, _mm_loadu_si128(reinterpret_cast<const __m128i *>(masks))),
+        _mm_shuffle_epi8(high, _mm_loadu_si128(reinterpret_cast<const __m128i *>(masks + 16))));
+    const __m128i p1 = _mm_or_si128(
+        _mm_shuffle_epi8(low, _mm_loadu_si128(reinterpret_cast<const __m128i *>(masks + 32))),
+        _mm_shuffle_epi8(high, _mm_loadu_si128(reinterpret_cast<const __m128i *>(masks + 48))));
+
+    const __m256i p0Wide = _mm256_cvtepu8_epi16(p0);
+    const __m256i p1Wide = _mm256_cvtepu8_epi16(p1);
+    const __m256i out = _mm256_add_epi16(p0Wide, _mm256_mulhrs_epi16(_mm256_sub_epi16(p1Wide, p0Wide), _mm256_loadu_si256(reinterpret_cast<const __m256i *>(weight))));
+
+    return _mm_packus_epi16(_mm256_castsi256_si128(out), _mm256_extracti128_si256(out, 1));
+}
+
+DERPERVIEW_TARGET_AVX2
+static void DerpRowAvx2(const int *blockBase, const uint8_t *shuffle, const int16_t *weight, unsigned int blockCount, const unsigned char *in, unsigned char *out)
+{
+    unsigned int block = 0;
+    while (block < blockCount)
+    {
+        const unsigned int x = block * SimdProcess::BlockWidth;
+        if (blockBase[block] < 0)
+        {
+            block++;
+        }
+        else if (block + 1 < blockCount && blockBase[block + 1] >= 0)
+        {
+            const __m256i result = Blend32(in + blockBase[block], in + blockBase[block + 1], shuffle + block * 64, shuffle + (block + 1) * 64, weight + x);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + x), result);
+            block += 2;
+        }
+        else
+        {
+            const __m128i result = Blend16(in + blockBase[block], shuffle + block * 64, weight + x);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x), result);
+            block++;
+        }
+    }
+}
+
+void Avx2Process::DerpRow(const GatherTable& table, const unsigned char *in, unsigned char *out)
+{
+    const ShuffleTable& shuffleTable = GetShuffleTable(table);
+    const unsigned int blockCount = static_cast<unsigned int>(shuffleTable.blockBase.size());
+    DerpRowAvx2(shuffleTable.blockBase.data(), shuffleTable.shuffle.data(), table.weight.data(), blockCount, in, out);
+    DerpRowScalarBlocks(table, shuffleTable, in, out);
+}
+
+#endif
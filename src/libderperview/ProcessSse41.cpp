@@ -0,0 +1,68 @@
+#include "Process.hpp"
+
+#ifdef DERPERVIEW_X86
+
+#include <smmintrin.h>
+
+// The kernels are built for their instruction set with a target attribute rather than a per-file
+// compiler flag, so that nothing else in here (inlined std:: code in particular) ends up needing SSE4.1.
+#if defined(__GNUC__) || defined(__clang__)
+    #define DERPERVIEW_TARGET_SSE41 __attribute__((target("sse4.1")))
+#else
+    #define DERPERVIEW_TARGET_SSE41
+#endif
+
+using namespace std;
+using namespace DerperView;
+
+DERPERVIEW_TARGET_SSE41
+static inline __m128i Blend16(const unsigned char *window, const uint8_t *masks, const int16_t *weight)
+{
+    const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i *>(window));
+    const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i *>(window + 16));
+
+    // Gather both source pixels for each output out of the 32 byte window. A mask byte with its top
+    // bit set gives zero, so each pixel comes from exactly one of the two halves.
+    const __m128i p0 = _mm_or_si128(
+        _mm_shuffle_epi8(low, _mm_loadu_si128(reinterpret_cast<const __m128i *>(masks))),
+        _mm_shuffle_epi8(high, _mm_loadu_si128(reinterpret_cast<const __m128i *>(masks + 16))));
+    const __m128i p1 = _mm_or_si128(
+        _mm_shuffle_epi8(low, _mm_loadu_si128(reinterpret_cast<const __m128i *>(masks + 32))),
+        _mm_shuffle_epi8(high, _mm_loadu_si128(reinterpret_cast<const __m128i *>(masks + 48))));
+
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i p0Low = _mm_cvtepu8_epi16(p0);
+    const __m128i p0High = _mm_unpackhi_epi8(p0, zero);
+    const __m128i p1Low = _mm_cvtepu8_epi16(p1);
+    const __m128i p1High = _mm_unpackhi_epi8(p1, zero);
+
+    // p0 + round((p1 - p0) * weight / 32768)
+    const __m128i outLow = _mm_add_epi16(p0Low, _mm_mulhrs_epi16(_mm_sub_epi16(p1Low, p0Low), _mm_loadu_si128(reinterpret_cast<const __m128i *>(weight))));
+    const __m128i outHigh = _mm_add_epi16(p0High, _mm_mulhrs_epi16(_mm_sub_epi16(p1High, p0High), _mm_loadu_si128(reinterpret_cast<const __m128i *>(weight + 8))));
+
+    return _mm_packus_epi16(outLow, outHigh);
+}
+
+DERPERVIEW_TARGET_SSE41
+static void DerpRowSse41(const int *blockBase, const uint8_t *shuffle, const int16_t *weight, unsigned int blockCount, const unsigned char *in, unsigned char *out)
+{
+    for (unsigned int block = 0; block < blockCount; block++)
+    {
+        if (blockBase[block] < 0)
+            continue;
+
+        const unsigned int x = block * SimdProcess::BlockWidth;
+        const __m128i result = Blend16(in + blockBase[block], shuffle + block * 64, weight + x);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x), result);
+    }
+}
+
+void Sse41Process::DerpRow(const GatherTable& table, const unsigned char *in, unsigned char *out)
+{
+    const ShuffleTable& shuffleTable = GetShuffleTable(table);
+    const unsigned int blockCount = static_cast<unsigned int>(shuffleTable.blockBase.size());
+    DerpRowSse41(shuffleTable.blockBase.data(), shuffleTable.shuffle.data(), table.weight.data(), blockCount, in, out);
+    DerpRowScalarBlocks(table, shuffleTable, in, out);
+}
+
+#endif
@@ -0,0 +1,89 @@
+#include "Progress.hpp"
+
+#include <chrono>
+#include <algorithm>
+
+using namespace DerperView;
+using namespace std;
+
+const int ProgressReporter::IntervalMilliseconds;
+const int ProgressReporter::StatusIntervalLooks;
+
+mutex& DerperView::GetOutputMutex()
+{
+    static mutex outputMutex;
+    return outputMutex;
+}
+
+ProgressReporter::ProgressReporter(int64_t totalFrames, ostream& outputStream, ProgressCallback callback) :
+    totalFrames_(totalFrames), outputStream_(outputStream), callback_(callback),
+    stopped_(false), reportedPercentage_(-1), looks_(0)
+{
+}
+
+ProgressReporter::~ProgressReporter()
+{
+    Stop();
+}
+
+void ProgressReporter::Start()
+{
+    // Anything counted before now, like segments done by an earlier run, doesn't get dots of its own
+    reported_.framesEncoded = counters_.framesEncoded.load(memory_order_relaxed);
+    thread_ = thread(&ProgressReporter::ThreadEntry, this);
+}
+
+void ProgressReporter::Stop()
+{
+    if (!thread_.joinable())
+        return;
+
+    {
+        lock_guard<mutex> lock(mutex_);
+        stopped_ = true;
+    }
+    stopping_.notify_all();
+    thread_.join();
+    Report();
+}
+
+void ProgressReporter::ThreadEntry()
+{
+    unique_lock<mutex> lock(mutex_);
+    while (!stopping_.wait_for(lock, chrono::milliseconds(IntervalMilliseconds), [this] { return stopped_; }))
+        Report();
+}
+
+void ProgressReporter::Report()
+{
+    ProgressUpdate update;
+    update.framesDecoded = counters_.framesDecoded.load(memory_order_relaxed);
+    update.framesStretched = counters_.framesStretched.load(memory_order_relaxed);
+    update.framesEncoded = counters_.framesEncoded.load(memory_order_relaxed);
+    update.bytesWritten = counters_.bytesWritten.load(memory_order_relaxed);
+    if (totalFrames_ > 0)
+        update.percentage = static_cast<int>(min<int64_t>(100, (update.framesEncoded * 100 + totalFrames_ - 1) / totalFrames_));
+
+    bool moved = update.framesDecoded != reported_.framesDecoded || update.framesStretched != reported_.framesStretched
+        || update.framesEncoded != reported_.framesEncoded || update.bytesWritten != reported_.bytesWritten;
+    bool encoded = update.framesEncoded != reported_.framesEncoded;
+    if (moved && callback_ != nullptr)
+        callback_(update);
+
+    if (encoded)
+    {
+        if (totalFrames_ > 0 && update.percentage != reportedPercentage_)
+        {
+            reportedPercentage_ = update.percentage;
+            Locked(outputStream_) << " " << update.percentage << "% " << flush;
+        }
+        else
+            Locked(outputStream_) << "." << flush;
+    }
+
+    if (++looks_ % StatusIntervalLooks == 0)
+        Locked(outputStream_) << " [decoded " << update.framesDecoded << ", stretched " << update.framesStretched << ", encoded " << update.framesEncoded
+            << " frames, " << update.bytesWritten / (1024 * 1024) << " MB written] " << flush;
+
+    reported_ = update;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+#include <cstdint>
+#include "libderperview.hpp"
+
+namespace DerperView
+{
+    // How far a job has got, bumped by each stage as it goes. They're only ever added to with relaxed atomics, so
+    // keeping count costs the stages nothing, and several pipelines can share the one set.
+    struct ProgressCounters
+    {
+        std::atomic<int64_t> framesDecoded{ 0 };
+        std::atomic<int64_t> framesStretched{ 0 };
+        std::atomic<int64_t> framesEncoded{ 0 };
+        std::atomic<int64_t> bytesWritten{ 0 }; // in packets written by the muxer
+    };
+
+    // Held for each write to a job's output stream. The reporter, the decode and mux threads and any segments
+    // running alongside each other all write to it, and a stream isn't safe to share without, whether it's cout
+    // or the GUI's ostringstream. Locked holds it for one statement:
+    //     Locked(outputStream) << "Something happened" << std::endl;
+    std::mutex& GetOutputMutex();
+
+    class LockedOutput
+    {
+    public:
+        explicit LockedOutput(std::ostream& stream) : lock_(GetOutputMutex()), stream_(stream) { }
+
+        template <typename T>
+        LockedOutput& operator<<(const T& value) { stream_ << value; return *this; }
+        LockedOutput& operator<<(std::ostream& (*manipulator)(std::ostream&)) { stream_ << manipulator; return *this; }
+
+    protected:
+        std::unique_lock<std::mutex> lock_;
+        std::ostream& stream_;
+    };
+
+    inline LockedOutput Locked(std::ostream& stream) { return LockedOutput(stream); }
+
+    // Looks at the counters a few times a second on a thread of its own and reports them, a dot for each look
+    // that finds more frames encoded, the percentage when it changes and all of the counters every
+    // StatusIntervalLooks looks. The callback gets them all whenever any of them has moved, from this thread.
+    class ProgressReporter
+    {
+    public:
+        // totalFrames can be 0 if it isn't known, in which case there are only dots
+        ProgressReporter(int64_t totalFrames, std::ostream& outputStream, ProgressCallback callback);
+        virtual ~ProgressReporter();
+
+        ProgressCounters& GetCounters() { return counters_; }
+
+        void Start();
+
+        // Reports one last time, so a job that finished says 100%
+        void Stop();
+
+        static const int IntervalMilliseconds = 250;
+        static const int StatusIntervalLooks = 40; // every ten seconds
+
+    protected:
+        void ThreadEntry();
+        void Report();
+
+        ProgressCounters counters_;
+        int64_t totalFrames_;
+        std::ostream& outputStream_;
+        ProgressCallback callback_;
+
+        std::thread thread_;
+        std::mutex mutex_;
+        std::condition_variable stopping_;
+        bool stopped_;
+        ProgressUpdate reported_;
+        int reportedPercentage_;
+        int looks_;
+    };
+}
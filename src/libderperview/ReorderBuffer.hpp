@@ -0,0 +1,125 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+
+namespace DerperView
+{
+    struct ReorderStats
+    {
+        size_t peakOccupancy; // Most items held at once waiting for an earlier one
+        double meanOccupancy; // Items held, averaged over every insert
+        std::chrono::microseconds totalWait; // Time items spent between arriving and being let out
+        std::chrono::microseconds maxWait;
+        int64_t itemCount;
+    };
+
+    // Takes items numbered 0, 1, 2 ... in any order and lets them out strictly in that order. Insert waits
+    // while an item is more than window ahead of the next one due out, so how much can pile up behind a slow
+    // item is bounded. Items live in a ring of window slots, so nothing is allocated as they pass through.
+    template <typename T>
+    class ReorderBuffer
+    {
+    public:
+        ReorderBuffer(size_t window) :
+            slots_(window), present_(window, false), arrived_(window),
+            next_(0), end_(-1), occupancy_(0), peakOccupancy_(0), occupancySum_(0), insertCount_(0),
+            totalWait_(0), maxWait_(0)
+        {
+        }
+
+        // Waits while sequence is too far ahead, and returns false without taking the item if it's at or past
+        // the end given to Close
+        bool Insert(int64_t sequence, T item)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            roomAhead_.wait(lock, [this, sequence] { return sequence < next_ + static_cast<int64_t>(slots_.size()) || (end_ >= 0 && sequence >= end_); });
+            if (end_ >= 0 && sequence >= end_)
+                return false;
+
+            size_t slot = static_cast<size_t>(sequence % slots_.size());
+            slots_[slot] = std::move(item);
+            present_[slot] = true;
+            arrived_[slot] = std::chrono::steady_clock::now();
+
+            occupancy_++;
+            peakOccupancy_ = std::max(peakOccupancy_, occupancy_);
+            occupancySum_ += occupancy_;
+            insertCount_++;
+
+            // Notified with the lock still held, as the last insert can be all the owner is waiting for before it
+            // destroys the buffer
+            if (sequence == next_)
+                nextArrived_.notify_one();
+            return true;
+        }
+
+        // Waits for the next item in sequence, and returns false once every item before the end has been let out
+        bool Pop(T& item)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            size_t slot = static_cast<size_t>(next_ % slots_.size());
+            nextArrived_.wait(lock, [this, slot] { return present_[slot] || (end_ >= 0 && next_ >= end_); });
+            if (!present_[slot])
+                return false;
+
+            item = std::move(slots_[slot]);
+            present_[slot] = false;
+            occupancy_--;
+            next_++;
+
+            auto waited = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - arrived_[slot]);
+            totalWait_ += waited;
+            maxWait_ = std::max(maxWait_, waited);
+
+            lock.unlock();
+            roomAhead_.notify_all();
+            return true;
+        }
+
+        // Items from 0 up to end - 1 are all that will arrive. Pop returns false once they've gone.
+        void Close(int64_t end)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                end_ = end;
+            }
+            nextArrived_.notify_all();
+            roomAhead_.notify_all();
+        }
+
+        ReorderStats GetStats() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ReorderStats stats;
+            stats.peakOccupancy = peakOccupancy_;
+            stats.meanOccupancy = insertCount_ > 0 ? static_cast<double>(occupancySum_) / insertCount_ : 0.0;
+            stats.totalWait = totalWait_;
+            stats.maxWait = maxWait_;
+            stats.itemCount = insertCount_;
+            return stats;
+        }
+
+        size_t GetWindow() const { return slots_.size(); }
+
+    protected:
+        std::vector<T> slots_;
+        std::vector<bool> present_;
+        std::vector<std::chrono::steady_clock::time_point> arrived_;
+        int64_t next_;
+        int64_t end_; // -1 until Close
+        size_t occupancy_;
+        size_t peakOccupancy_;
+        uint64_t occupancySum_;
+        int64_t insertCount_;
+        std::chrono::microseconds totalWait_;
+        std::chrono::microseconds maxWait_;
+        mutable std::mutex mutex_;
+        std::condition_variable nextArrived_;
+        std::condition_variable roomAhead_;
+    };
+}
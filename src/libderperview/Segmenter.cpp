@@ -0,0 +1,272 @@
+#include "Segmenter.hpp"
+#include "Progress.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+using namespace DerperView;
+using namespace std;
+
+// output.mp4 becomes output.part0.mp4, so the segments go in the same sort of container as the output
+string SegmentFilename(const string& outputFilename, size_t index)
+{
+    size_t dot = outputFilename.find_last_of('.');
+    size_t separator = outputFilename.find_last_of("/\\");
+    if (dot == string::npos || (separator != string::npos && dot < separator))
+        dot = outputFilename.size();
+    return outputFilename.substr(0, dot) + ".part" + to_string(index) + outputFilename.substr(dot);
+}
+
+Segmenter::Segmenter(string inputFilename, string outputFilename, ostream& outputStream) :
+    inputFilename_(inputFilename), outputFilename_(outputFilename), outputStream_(outputStream),
+    outputContext_(nullptr), videoStream_(nullptr), audioStream_(nullptr),
+    segmentContext_(nullptr), segmentStreamIndex_(-1), segmentIndex_(0), segmentOffset_(0), frameRate_({ 0, 1 }),
+    sourceContext_(nullptr), sourceAudioIndex_(-1), lastError_(0)
+{
+}
+
+Segmenter::~Segmenter()
+{
+    avformat_close_input(&segmentContext_);
+    avformat_close_input(&sourceContext_);
+    if (outputContext_ != nullptr)
+    {
+        avio_closep(&outputContext_->pb);
+        avformat_free_context(outputContext_);
+    }
+}
+
+void Segmenter::Plan(const vector<int64_t>& keyframes, unsigned int count)
+{
+    // Cut at the keyframes nearest to evenly spaced points, leaving out any that would make an empty segment
+    vector<int64_t> cuts;
+    if (keyframes.size() > 1)
+    {
+        int64_t first = keyframes.front();
+        int64_t last = keyframes.back();
+        for (unsigned int i = 1; i < count; i++)
+        {
+            int64_t target = first + (last - first) * i / count;
+            auto keyframe = lower_bound(keyframes.begin(), keyframes.end(), target);
+            if (keyframe == keyframes.end())
+                --keyframe;
+            if (keyframe != keyframes.begin() && target - *(keyframe - 1) < *keyframe - target)
+                --keyframe;
+            if (*keyframe > first && (cuts.empty() || *keyframe > cuts.back()))
+                cuts.push_back(*keyframe);
+        }
+    }
+
+    segments_.clear();
+    int64_t start = AV_NOPTS_VALUE; // the first segment starts wherever the file does, same as a single pass
+    for (size_t i = 0; i <= cuts.size(); i++)
+    {
+        Segment segment;
+        segment.start = start;
+        segment.end = i < cuts.size() ? cuts[i] : AV_NOPTS_VALUE;
+        segment.filename = SegmentFilename(outputFilename_, i);
+        segment.frameCount = 0;
+        segments_.push_back(segment);
+        start = segment.end;
+    }
+}
+
+int Segmenter::Join(AVRational frameRate, AudioMode audioMode)
+{
+    frameRate_ = frameRate;
+    lastError_ = OpenSegment(0);
+    if (lastError_ < 0)
+        return lastError_;
+
+    lastError_ = avformat_alloc_output_context2(&outputContext_, nullptr, nullptr, outputFilename_.c_str());
+    if (lastError_ < 0 || outputContext_ == nullptr)
+    {
+        Locked(outputStream_) << "Could not create format context: " << GetErrorString(lastError_) << endl;
+        return lastError_;
+    }
+
+    // The video is as the segments have it, and they all have it the same
+    AVStream *segmentStream = segmentContext_->streams[segmentStreamIndex_];
+    videoStream_ = avformat_new_stream(outputContext_, nullptr);
+    lastError_ = avcodec_parameters_copy(videoStream_->codecpar, segmentStream->codecpar);
+    if (lastError_ < 0)
+        return lastError_;
+    videoStream_->codecpar->codec_tag = 0;
+    videoStream_->time_base = segmentStream->time_base;
+    videoStream_->avg_frame_rate = frameRate;
+    videoStream_->r_frame_rate = frameRate;
+
+    if (audioMode == AudioMode::Copy)
+    {
+        lastError_ = avformat_open_input(&sourceContext_, inputFilename_.c_str(), nullptr, nullptr);
+        if (lastError_ >= 0)
+            lastError_ = avformat_find_stream_info(sourceContext_, nullptr);
+        if (lastError_ >= 0)
+            lastError_ = sourceAudioIndex_ = av_find_best_stream(sourceContext_, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+        if (lastError_ < 0)
+        {
+            Locked(outputStream_) << "Could not open the source's audio: " << GetErrorString(lastError_) << endl;
+            return lastError_;
+        }
+
+        AVStream *sourceStream = sourceContext_->streams[sourceAudioIndex_];
+        audioStream_ = avformat_new_stream(outputContext_, nullptr);
+        lastError_ = avcodec_parameters_copy(audioStream_->codecpar, sourceStream->codecpar);
+        if (lastError_ < 0)
+            return lastError_;
+        audioStream_->codecpar->codec_tag = 0;
+        audioStream_->time_base = sourceStream->time_base;
+    }
+
+    av_dump_format(outputContext_, 0, outputFilename_.c_str(), 1);
+
+    lastError_ = avio_open(&outputContext_->pb, outputFilename_.c_str(), AVIO_FLAG_WRITE);
+    if (lastError_ < 0)
+    {
+        Locked(outputStream_) << "Error opening output file: " << GetErrorString(lastError_) << endl;
+        return lastError_;
+    }
+    lastError_ = avformat_write_header(outputContext_, nullptr);
+    if (lastError_ < 0)
+    {
+        Locked(outputStream_) << "Could not write container header: " << GetErrorString(lastError_) << endl;
+        return lastError_;
+    }
+
+    // Whichever stream is behind goes next, so the muxer gets them already interleaved
+    AVPacket *video = av_packet_alloc();
+    AVPacket *audio = av_packet_alloc();
+    bool haveVideo = ReadVideoPacket(video);
+    bool haveAudio = audioStream_ != nullptr && ReadAudioPacket(audio);
+    while ((haveVideo || haveAudio) && lastError_ >= 0)
+    {
+        if (!haveAudio || (haveVideo && av_compare_ts(video->dts, videoStream_->time_base, audio->dts, audioStream_->time_base) <= 0))
+        {
+            lastError_ = av_interleaved_write_frame(outputContext_, video);
+            haveVideo = lastError_ >= 0 && ReadVideoPacket(video);
+        }
+        else
+        {
+            lastError_ = av_interleaved_write_frame(outputContext_, audio);
+            haveAudio = lastError_ >= 0 && ReadAudioPacket(audio);
+        }
+    }
+    av_packet_free(&video);
+    av_packet_free(&audio);
+
+    if (lastError_ < 0)
+    {
+        Locked(outputStream_) << "Could not join segments: " << GetErrorString(lastError_) << endl;
+        return lastError_;
+    }
+    return av_write_trailer(outputContext_);
+}
+
+void Segmenter::RemoveSegmentFiles()
+{
+    avformat_close_input(&segmentContext_);
+    for (auto& segment : segments_)
+        remove(segment.filename.c_str());
+}
+
+void Segmenter::RemoveSegmentFile(unsigned int index)
+{
+    if (index < segments_.size())
+        remove(segments_[index].filename.c_str());
+}
+
+bool Segmenter::ReadVideoPacket(AVPacket *packet)
+{
+    while (segmentContext_ != nullptr)
+    {
+        int result = av_read_frame(segmentContext_, packet);
+        if (result >= 0)
+        {
+            if (packet->stream_index != segmentStreamIndex_)
+            {
+                av_packet_unref(packet);
+                continue;
+            }
+            av_packet_rescale_ts(packet, segmentContext_->streams[segmentStreamIndex_]->time_base, videoStream_->time_base);
+            if (packet->pts != AV_NOPTS_VALUE)
+                packet->pts += segmentOffset_;
+            if (packet->dts != AV_NOPTS_VALUE)
+                packet->dts += segmentOffset_;
+            packet->stream_index = videoStream_->index;
+            packet->pos = -1;
+            return true;
+        }
+
+        avformat_close_input(&segmentContext_);
+        if (result != AVERROR_EOF)
+        {
+            lastError_ = result;
+            Locked(outputStream_) << "Could not read segment " << segmentIndex_ << ": " << GetErrorString(result) << endl;
+            return false;
+        }
+        if (segmentIndex_ + 1 >= segments_.size())
+            return false;
+
+        // The next segment's frame 0 goes right after this one's last frame
+        segmentOffset_ += av_rescale_q(segments_[segmentIndex_].frameCount, av_inv_q(frameRate_), videoStream_->time_base);
+        lastError_ = OpenSegment(segmentIndex_ + 1);
+        if (lastError_ < 0)
+            return false;
+    }
+    return false;
+}
+
+bool Segmenter::ReadAudioPacket(AVPacket *packet)
+{
+    int result = 0;
+    while ((result = av_read_frame(sourceContext_, packet)) >= 0)
+    {
+        if (packet->stream_index == sourceAudioIndex_)
+        {
+            av_packet_rescale_ts(packet, sourceContext_->streams[sourceAudioIndex_]->time_base, audioStream_->time_base);
+            packet->stream_index = audioStream_->index;
+            packet->pos = -1;
+            return true;
+        }
+        av_packet_unref(packet);
+    }
+
+    if (result != AVERROR_EOF)
+    {
+        lastError_ = result;
+        Locked(outputStream_) << "Could not read the source's audio: " << GetErrorString(result) << endl;
+    }
+    return false;
+}
+
+int Segmenter::OpenSegment(size_t index)
+{
+    segmentIndex_ = index;
+    const string& filename = segments_[index].filename;
+    int result = avformat_open_input(&segmentContext_, filename.c_str(), nullptr, nullptr);
+    if (result >= 0)
+        result = avformat_find_stream_info(segmentContext_, nullptr);
+    if (result >= 0)
+        result = segmentStreamIndex_ = av_find_best_stream(segmentContext_, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (result < 0)
+    {
+        Locked(outputStream_) << "Could not open segment '" << filename << "': " << GetErrorString(result) << endl;
+        return result;
+    }
+
+    // A change of SPS or PPS part way through would need a second sample description, which isn't worth it
+    // for streams that should be identical anyway
+    const AVCodecParameters *parameters = segmentContext_->streams[segmentStreamIndex_]->codecpar;
+    if (videoStream_ != nullptr && (parameters->extradata_size != videoStream_->codecpar->extradata_size
+        || (parameters->extradata_size > 0 && memcmp(parameters->extradata, videoStream_->codecpar->extradata, parameters->extradata_size) != 0)))
+    {
+        Locked(outputStream_) << "Segment '" << filename << "' was encoded with different stream parameters to the first" << endl;
+        return AVERROR(EINVAL);
+    }
+
+    // Encoded somewhere else, the file knows how many frames went in
+    if (segments_[index].frameCount == 0)
+        segments_[index].frameCount = segmentContext_->streams[segmentStreamIndex_]->nb_frames;
+    return 0;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "Video.hpp"
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <cstdint>
+
+namespace DerperView
+{
+    // One stretch of the source, encoded to a file of its own
+    struct Segment
+    {
+        int64_t start; // first frame's timestamp in the source's video time base, AV_NOPTS_VALUE from the start
+        int64_t end; // first frame of the next segment, AV_NOPTS_VALUE to the end
+        std::string filename;
+        int64_t frameCount; // frames encoded, filled in once it's done or read from its file when joining
+    };
+
+    // Splits a job up into segments that start on keyframes, so each one can go through a pipeline of its own
+    // at the same time as the others, then joins the encoded segments back together at the packet level.
+    class Segmenter
+    {
+    public:
+        Segmenter(std::string inputFilename, std::string outputFilename, std::ostream& outputStream = std::cout);
+        virtual ~Segmenter();
+
+        // Cuts the source into up to count segments, as even as the keyframes allow. keyframes comes from
+        // InputVideoFile::GetKeyframes.
+        void Plan(const std::vector<int64_t>& keyframes, unsigned int count);
+        std::vector<Segment>& GetSegments() { return segments_; }
+
+        // Writes the segments' packets one after another into the output, each shifted along by the frames
+        // before it. Every segment was encoded from frame 0 with the same settings, so the timestamps carry on
+        // where the last segment left off and the stream parameters are the same throughout. With Copy, the
+        // source's audio is copied in alongside.
+        int Join(AVRational frameRate, AudioMode audioMode);
+
+        void RemoveSegmentFiles();
+        void RemoveSegmentFile(unsigned int index);
+
+    protected:
+        // Moves on to the next segment when the current one runs out. Returns false after the last.
+        bool ReadVideoPacket(AVPacket *packet);
+        bool ReadAudioPacket(AVPacket *packet);
+        int OpenSegment(size_t index);
+
+        std::string inputFilename_;
+        std::string outputFilename_;
+        std::ostream& outputStream_;
+        std::vector<Segment> segments_;
+
+        AVFormatContext *outputContext_;
+        AVStream *videoStream_;
+        AVStream *audioStream_;
+        AVFormatContext *segmentContext_;
+        int segmentStreamIndex_;
+        size_t segmentIndex_;
+        int64_t segmentOffset_; // where the current segment starts, in videoStream_'s time base
+        AVRational frameRate_;
+        AVFormatContext *sourceContext_;
+        int sourceAudioIndex_;
+        int lastError_;
+    };
+}
@@ -0,0 +1,162 @@
+#include "ThreadPool.hpp"
+#include <atomic>
+#include <memory>
+#include <algorithm>
+
+using namespace std;
+using namespace DerperView;
+
+ThreadPool::ThreadPool(unsigned int threadCount) : queue_(64), queueHead_(0), queueCount_(0), activeThreads_(threadCount), stopping_(false)
+{
+    for (unsigned int i = 0; i < threadCount; i++)
+        threads_.emplace_back(&ThreadPool::WorkerEntry, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+
+    for (auto& t : threads_)
+        t.join();
+}
+
+void ThreadPool::Submit(function<void()> task)
+{
+    bool throttled;
+    {
+        lock_guard<mutex> lock(mutex_);
+        throttled = activeThreads_ < threads_.size();
+        if (queueCount_ == queue_.size())
+        {
+            // Full, so unwrap into a ring twice the size
+            vector<function<void()>> bigger(queue_.size() * 2);
+            for (size_t i = 0; i < queueCount_; i++)
+                bigger[i] = move(queue_[(queueHead_ + i) % queue_.size()]);
+            queue_.swap(bigger);
+            queueHead_ = 0;
+        }
+        queue_[(queueHead_ + queueCount_) % queue_.size()] = move(task);
+        queueCount_++;
+    }
+
+    // A single wake up could go to a sleeping thread that isn't allowed to take the task
+    if (throttled)
+        wake_.notify_all();
+    else
+        wake_.notify_one();
+}
+
+void ThreadPool::SetActiveThreadCount(unsigned int count)
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        activeThreads_ = max(1u, min(count, GetThreadCount()));
+    }
+    wake_.notify_all();
+}
+
+unsigned int ThreadPool::GetActiveThreadCount() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return activeThreads_;
+}
+
+void ThreadPool::WorkerEntry(unsigned int index)
+{
+    while (true)
+    {
+        function<void()> task;
+        {
+            unique_lock<mutex> lock(mutex_);
+            wake_.wait(lock, [this, index] { return stopping_ || (queueCount_ > 0 && index < activeThreads_); });
+            if (queueCount_ == 0 || index >= activeThreads_)
+                return; // Stopping, and nothing left to do that the active threads won't get to
+            task = move(queue_[queueHead_]);
+            queue_[queueHead_] = nullptr;
+            queueHead_ = (queueHead_ + 1) % queue_.size();
+            queueCount_--;
+        }
+        task();
+    }
+}
+
+void ThreadPool::ParallelFor(unsigned int count, void (*call)(const void *, unsigned int), const void *context)
+{
+    if (count == 0)
+        return;
+
+    // Helpers can still be sitting in the queue after the caller has returned, so the state only goes back for
+    // another call once the last of them has let go of it. call and context are only used for an index that's
+    // been claimed, which the caller waits to finish, so they can live on its stack.
+    ParallelForState *state = TakeParallelForState();
+    unsigned int helpers = min(GetActiveThreadCount(), count - 1);
+    state->call = call;
+    state->context = context;
+    state->count = count;
+    state->next = 0;
+    state->references = helpers + 1;
+    state->completed = 0;
+
+    for (unsigned int i = 0; i < helpers; i++)
+    {
+        Submit([this, state]()
+        {
+            RunParallelFor(state);
+            ReleaseParallelForState(state);
+        });
+    }
+
+    RunParallelFor(state);
+    {
+        unique_lock<mutex> lock(state->completedMutex);
+        state->allCompleted.wait(lock, [state] { return state->completed == state->count; });
+    }
+    ReleaseParallelForState(state);
+}
+
+void ThreadPool::RunParallelFor(ParallelForState *state)
+{
+    unsigned int done = 0;
+    for (unsigned int i = state->next++; i < state->count; i = state->next++)
+    {
+        state->call(state->context, i);
+        done++;
+    }
+
+    if (done > 0)
+    {
+        lock_guard<mutex> lock(state->completedMutex);
+        state->completed += done;
+        if (state->completed == state->count)
+            state->allCompleted.notify_all();
+    }
+}
+
+ThreadPool::ParallelForState *ThreadPool::TakeParallelForState()
+{
+    lock_guard<mutex> lock(mutex_);
+    if (freeParallelForStates_.empty())
+    {
+        // Room for all of them on the free list, so handing one back never has to grow it
+        parallelForStates_.emplace_back(new ParallelForState());
+        freeParallelForStates_.reserve(parallelForStates_.size());
+        return parallelForStates_.back().get();
+    }
+
+    ParallelForState *state = freeParallelForStates_.back();
+    freeParallelForStates_.pop_back();
+    return state;
+}
+
+void ThreadPool::ReleaseParallelForState(ParallelForState *state)
+{
+    if (state->references.fetch_sub(1, memory_order_acq_rel) != 1)
+        return;
+
+    lock_guard<mutex> lock(mutex_);
+    freeParallelForStates_.push_back(state);
+}
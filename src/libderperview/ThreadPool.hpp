@@ -0,0 +1,71 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace DerperView
+{
+    // Fixed set of worker threads fed from one queue. The queue is a ring that grows when it has to and never
+    // shrinks, so once it's big enough submitting a task doesn't allocate.
+    class ThreadPool
+    {
+    public:
+        ThreadPool(unsigned int threadCount);
+        virtual ~ThreadPool();
+
+        void Submit(std::function<void()> task);
+
+        // Runs task(0) .. task(count - 1) on the pool and the calling thread, and returns once they've all
+        // finished. The caller does its share of the work rather than just waiting, so this is safe to call
+        // from inside a pool task. task is used where it is rather than copied, and what the threads share is
+        // kept for the next call, so once the pool has warmed up this doesn't allocate.
+        template <typename Task>
+        void ParallelFor(unsigned int count, const Task& task)
+        {
+            ParallelFor(count, [](const void *context, unsigned int i) { (*static_cast<const Task *>(context))(i); }, &task);
+        }
+        void ParallelFor(unsigned int count, void (*call)(const void *context, unsigned int i), const void *context);
+
+        unsigned int GetThreadCount() const { return static_cast<unsigned int>(threads_.size()); }
+
+        // Only the first count threads pick up tasks, the rest sleep until they're let back in. Lets the pool
+        // be sized for the whole machine and then throttled to what the job actually needs.
+        void SetActiveThreadCount(unsigned int count);
+        unsigned int GetActiveThreadCount() const;
+
+    protected:
+        // One ParallelFor call's work, shared by the caller and its helpers
+        struct ParallelForState
+        {
+            void (*call)(const void *, unsigned int);
+            const void *context;
+            unsigned int count;
+            std::atomic<unsigned int> next;
+            std::atomic<unsigned int> references; // the caller and helpers that haven't let go of it yet
+            unsigned int completed;
+            std::mutex completedMutex;
+            std::condition_variable allCompleted;
+        };
+
+        void WorkerEntry(unsigned int index);
+        ParallelForState *TakeParallelForState();
+        void ReleaseParallelForState(ParallelForState *state);
+        static void RunParallelFor(ParallelForState *state);
+
+        std::vector<std::thread> threads_;
+        std::vector<std::function<void()>> queue_;
+        size_t queueHead_;
+        size_t queueCount_;
+        unsigned int activeThreads_;
+        mutable std::mutex mutex_;
+        std::condition_variable wake_;
+        bool stopping_;
+        std::vector<std::unique_ptr<ParallelForState>> parallelForStates_;
+        std::vector<ParallelForState *> freeParallelForStates_; // under mutex_
+    };
+}
@@ -0,0 +1,63 @@
+#include "ThreadTuner.hpp"
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace DerperView;
+using namespace std;
+
+const int64_t ThreadTuner::AdjustInterval;
+
+ThreadTuner::ThreadTuner(ThreadPool& pool, unsigned int initialThreads) :
+    pool_(pool), initialThreads_(initialThreads), threads_(initialThreads), adjustmentCount_(0),
+    stretchNanoseconds_(0), stretchCount_(0), encodeNanoseconds_(0), encodeCount_(0)
+{
+    pool_.SetActiveThreadCount(threads_);
+}
+
+unsigned int ThreadTuner::GetInitialThreadCount(unsigned int hardwareThreads, int width, int height)
+{
+    // Roughly one thread per 2 megapixels, which keeps up with x264 on the usual presets, but never more than
+    // a quarter of the machine to start with. The encoder wants the rest. Two keeps a stretch going while the
+    // last one's results are being handed on, as long as there are two to be had.
+    unsigned int megapixelPairs = static_cast<unsigned int>(static_cast<int64_t>(width) * height / (2 * 1024 * 1024));
+    return max(1u, min(hardwareThreads, max(2u, min(max(1u, hardwareThreads / 4), megapixelPairs))));
+}
+
+void ThreadTuner::StretchFinished(chrono::nanoseconds time)
+{
+    stretchNanoseconds_ += time.count();
+    stretchCount_++;
+}
+
+void ThreadTuner::FrameEncoded(chrono::nanoseconds time)
+{
+    encodeNanoseconds_ += time.count();
+    encodeCount_++;
+    if (encodeCount_ < AdjustInterval)
+        return;
+
+    int64_t stretchCount = stretchCount_.exchange(0);
+    int64_t stretchNanoseconds = stretchNanoseconds_.exchange(0);
+    if (stretchCount > 0 && encodeNanoseconds_ > 0)
+    {
+        // Enough threads that stretches come out at least as fast as the encoder takes them, with a bit of slack
+        // for the slow ones
+        double stretchTime = static_cast<double>(stretchNanoseconds) / stretchCount;
+        double encodeTime = static_cast<double>(encodeNanoseconds_) / encodeCount_;
+        // The pool was built with the most the stretch may have, so this can go up as well as down within it
+        unsigned int wanted = static_cast<unsigned int>(ceil(stretchTime / encodeTime * 1.5));
+        wanted = max(1u, min(wanted, pool_.GetThreadCount()));
+
+        if (wanted != threads_)
+        {
+            threads_ = wanted;
+            adjustmentCount_++;
+            pool_.SetActiveThreadCount(threads_);
+        }
+    }
+
+    encodeNanoseconds_ = 0;
+    encodeCount_ = 0;
+}
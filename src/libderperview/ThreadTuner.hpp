@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace DerperView
+{
+    class ThreadPool;
+
+    // Works out how many threads the stretch should get out of a job's total. x264 runs its own threads, so the
+    // aim is to keep just enough stretching going to keep the encoder fed and leave the rest to it. Starts from a guess based on the frame size and then, every so many
+    // frames, compares how long a stretch takes with how long the encoder takes per frame.
+    class ThreadTuner
+    {
+    public:
+        // pool wants to be built with the most threads the stretch may use, which is as far as the tuner goes.
+        // It starts off with initialThreads of them active.
+        ThreadTuner(ThreadPool& pool, unsigned int initialThreads);
+
+        // Never more than hardwareThreads
+        static unsigned int GetInitialThreadCount(unsigned int hardwareThreads, int width, int height);
+
+        // Called from the pool threads as each stretch finishes
+        void StretchFinished(std::chrono::nanoseconds time);
+
+        // Called from the encoder thread for each video frame. May change the pool's active thread count.
+        void FrameEncoded(std::chrono::nanoseconds time);
+
+        unsigned int GetInitialThreads() const { return initialThreads_; }
+        unsigned int GetThreads() const { return threads_; }
+        unsigned int GetAdjustmentCount() const { return adjustmentCount_; }
+
+        static const int64_t AdjustInterval = 50; // frames between adjustments
+
+    protected:
+        ThreadPool& pool_;
+        unsigned int initialThreads_;
+        unsigned int threads_;
+        unsigned int adjustmentCount_;
+
+        std::atomic<int64_t> stretchNanoseconds_;
+        std::atomic<int64_t> stretchCount_;
+        int64_t encodeNanoseconds_;
+        int64_t encodeCount_;
+    };
+}
@@ -1,23 +1,97 @@
 #include "Video.hpp"
+#include "AllocationCounter.hpp"
+#include "Progress.hpp"
+#include "ThreadPool.hpp"
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <functional>
 
 extern "C"
 {
     #include "libswscale/swscale.h"
 }
 
+#ifdef _WIN32
+    #define NOMINMAX
+    #include <windows.h>
+    #define fseeko _fseeki64
+    #define ftello _ftelli64
+#endif
+
 using namespace DerperView;
 using namespace std;
 
-int SetupContextWorker(AVFormatContext *formatContext, AVCodecContext **codecContext, AVMediaType type, ostream& outputStream)
+// fopen, but taking a UTF-8 filename everywhere like libav does
+FILE *OpenUtf8(const string& filename, const char *mode)
+{
+#ifdef _WIN32
+    wstring wideFilename(MultiByteToWideChar(CP_UTF8, 0, filename.c_str(), -1, nullptr, 0), L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, filename.c_str(), -1, &wideFilename[0], static_cast<int>(wideFilename.size()));
+    wstring wideMode(mode, mode + strlen(mode));
+    return _wfopen(wideFilename.c_str(), wideMode.c_str());
+#else
+    return fopen(filename.c_str(), mode);
+#endif
+}
+
+// get_buffer2 for a decoder whose opaque is a CodecCallbackData
+int GetPooledBuffer(AVCodecContext *context, AVFrame *frame, int flags)
+{
+    FramePool *framePool = static_cast<CodecCallbackData *>(context->opaque)->framePool;
+    if (framePool == nullptr)
+        return avcodec_default_get_buffer2(context, frame, flags);
+    return framePool->GetBuffer(context, frame, flags);
+}
+
+// execute for a codec whose opaque is a CodecCallbackData. The jobs go on the pool alongside the stretches, and
+// the calling thread does its share, so there's no waiting on a pool that's busy.
+int ExecuteOnPool(AVCodecContext *context, int (*job)(AVCodecContext *, void *), void *arguments, int *results, int count, int size)
+{
+    CodecCallbackData *callbacks = static_cast<CodecCallbackData *>(context->opaque);
+    callbacks->executeCalls++;
+    ThreadPool *threadPool = callbacks->threadPool;
+    threadPool->ParallelFor(static_cast<unsigned int>(count), [=](unsigned int i)
+    {
+        int result = job(context, static_cast<char *>(arguments) + static_cast<size_t>(i) * size);
+        if (results != nullptr)
+            results[i] = result;
+    });
+    return 0;
+}
+
+// draw_horiz_band for a decoder whose opaque is a CodecCallbackData
+void DrawBand(AVCodecContext *context, const AVFrame *frame, int[AV_NUM_DATA_POINTERS], int y, int, int height)
+{
+    auto& drawBand = static_cast<CodecCallbackData *>(context->opaque)->drawBand;
+    if (drawBand)
+        drawBand(frame, y, height);
+}
+
+// Once libavcodec has threads of its own for a codec it's put in its own execute, and takes the threads from our
+// budget whether we share or not. execute2 stays as it is, because its jobs keep scratch space per thread number
+// and with thread_count at 1 they'd all be sharing the one lot.
+bool ShareThreadPool(AVCodecContext *context, CodecCallbackData& callbacks, ThreadPool& pool)
+{
+    if (context == nullptr || context->active_thread_type != 0)
+        return false;
+
+    callbacks.threadPool = &pool;
+    context->opaque = &callbacks;
+    context->execute = &ExecuteOnPool;
+    return true;
+}
+
+// configure gets a look at the codec context before it's opened, for anything that has to be set up front
+int SetupContextWorker(AVFormatContext *formatContext, AVCodecContext **codecContext, AVMediaType type, ostream& outputStream, function<void(AVCodecContext *)> configure)
 {
     auto result = av_find_best_stream(formatContext, type, -1, -1, nullptr, 0);
     if (result < 0)
     {
-        outputStream << "Could not find stream for " << av_get_media_type_string (type) << ": " << GetErrorString(result) << endl;
+        Locked(outputStream) << "Could not find stream for " << av_get_media_type_string (type) << ": " << GetErrorString(result) << endl;
         return result;
     }
 
@@ -27,23 +101,25 @@ int SetupContextWorker(AVFormatContext *formatContext, AVCodecContext **codecCon
     const AVCodec *decoder = avcodec_find_decoder(stream->codecpar->codec_id);
     if (!decoder)
     {
-        outputStream << "Failed to find codec: " << av_get_media_type_string(type) << ": " << GetErrorString(result) << endl;
+        Locked(outputStream) << "Failed to find codec: " << av_get_media_type_string(type) << ": " << GetErrorString(result) << endl;
         return -666;
     }
 
     *codecContext = avcodec_alloc_context3(decoder);
     if (!*codecContext)
     {
-        outputStream << "Failed to allocation codec context: " << av_get_media_type_string(type) << ": " << GetErrorString(result) << endl;
+        Locked(outputStream) << "Failed to allocation codec context: " << av_get_media_type_string(type) << ": " << GetErrorString(result) << endl;
         return -666;
     }
 
     avcodec_parameters_to_context(*codecContext, stream->codecpar);
+    if (configure)
+        configure(*codecContext);
 
     result = avcodec_open2(*codecContext, decoder, nullptr);
     if (result < 0)
     {
-        outputStream << "Failed to open codec: " << av_get_media_type_string(type) << ": " << GetErrorString(result) << endl;
+        Locked(outputStream) << "Failed to open codec: " << av_get_media_type_string(type) << ": " << GetErrorString(result) << endl;
         return -666;
     }
     (*codecContext)->time_base = stream->time_base;
@@ -51,23 +127,27 @@ int SetupContextWorker(AVFormatContext *formatContext, AVCodecContext **codecCon
     return streamIndex;
 }
 
-int SetupVideoContext(AVFormatContext *formatContext, AVCodecContext **codecContext, ostream& outputStream)
+int SetupVideoContext(AVFormatContext *formatContext, AVCodecContext **codecContext, ostream& outputStream, function<void(AVCodecContext *)> configure)
 {
-    return SetupContextWorker(formatContext, codecContext, AVMediaType::AVMEDIA_TYPE_VIDEO, outputStream);
+    return SetupContextWorker(formatContext, codecContext, AVMediaType::AVMEDIA_TYPE_VIDEO, outputStream, configure);
 }
 
 int SetupAudioContext(AVFormatContext *formatContext, AVCodecContext **codecContext, ostream& outputStream)
 {
-    return SetupContextWorker(formatContext, codecContext, AVMediaType::AVMEDIA_TYPE_AUDIO, outputStream);
+    return SetupContextWorker(formatContext, codecContext, AVMediaType::AVMEDIA_TYPE_AUDIO, outputStream, nullptr);
 }
 
-InputVideoFile::InputVideoFile(string filename, ostream& outputStream) :
+InputVideoFile::InputVideoFile(string filename, ostream& outputStream, bool useHugePages, int decoderThreads, int decoderThreadType) :
     filename_(filename),
     outputStream_(outputStream),
+    framePool_(useHugePages), videoCallbacks_({ &framePool_, nullptr, nullptr, 0 }),
     formatContext_(nullptr), videoCodecContext_(nullptr), audioCodecContext_(nullptr),
     videoStreamIndex_(-1), audioStreamIndex_(-1),
-    frame_(nullptr), packet_(nullptr), draining_(false), lastError_(0),
-    videoFrameCount_(0)
+    frame_(nullptr), packet_(nullptr), audioMode_(AudioMode::None), draining_(false),
+    rangeStart_(AV_NOPTS_VALUE), rangeEnd_(AV_NOPTS_VALUE), pastRange_(false), lastError_(0),
+    videoFrameCount_(0),
+    readAheadBytes_(0), freeReadPackets_(ReadAheadPackets), readQueue_(ReadAheadPackets),
+    readStopping_(false), readError_(0), readNanoseconds_(0), waitNanoseconds_(0), decodeNanoseconds_(0)
 {
 #if LIBAVFORMAT_VERSION_MAJOR < 58
     // need to register all muxers, decoders, ... on ffmpeg versions before 58.x, see
@@ -78,17 +158,24 @@ InputVideoFile::InputVideoFile(string filename, ostream& outputStream) :
     lastError_ = avformat_open_input(&formatContext_, filename_.c_str(), nullptr, nullptr);
     if (lastError_ < 0)
     {
-        outputStream << "Error on opening file '" << filename_ << "': " << GetErrorString(lastError_) << endl;
+        Locked(outputStream) << "Error on opening file '" << filename_ << "': " << GetErrorString(lastError_) << endl;
         return;
     }
 
     lastError_ = avformat_find_stream_info(formatContext_, nullptr);
     if (lastError_ < 0) {
-        outputStream << "Could not read streams: " << GetErrorString(lastError_) << endl;
+        Locked(outputStream) << "Could not read streams: " << GetErrorString(lastError_) << endl;
         return;
     }
 
-    videoStreamIndex_ = SetupVideoContext(formatContext_, &videoCodecContext_, outputStream_);
+    // Decoded pictures go into our own aligned, pooled buffers rather than libavcodec's. Unless the decoder is
+    // given threads of its own, its slice jobs can go on our pool instead.
+    videoStreamIndex_ = SetupVideoContext(formatContext_, &videoCodecContext_, outputStream_, [this, decoderThreads, decoderThreadType](AVCodecContext *context) {
+        context->opaque = &videoCallbacks_;
+        context->get_buffer2 = &GetPooledBuffer;
+        context->thread_count = decoderThreads;
+        context->thread_type = decoderThreadType;
+    });
     audioStreamIndex_ = SetupAudioContext(formatContext_, &audioCodecContext_, outputStream_);
 
     frame_ = av_frame_alloc();
@@ -97,6 +184,10 @@ InputVideoFile::InputVideoFile(string filename, ostream& outputStream) :
 
 InputVideoFile::~InputVideoFile()
 {
+    StopReadAhead();
+    for (auto packet : readPackets_)
+        av_packet_free(&packet);
+
     av_frame_free(&frame_);
     av_packet_free(&packet_);
     avcodec_free_context(&videoCodecContext_);
@@ -113,13 +204,28 @@ void InputVideoFile::Dump()
 
 AVFrame *InputVideoFile::GetNextFrame()
 {
+    // Whatever time isn't spent waiting for packets goes down to decoding
+    auto started = chrono::steady_clock::now();
+    int64_t waited = waitNanoseconds_;
+    AVFrame *frame = DecodeNextFrame();
+    decodeNanoseconds_ += (chrono::steady_clock::now() - started).count() - (waitNanoseconds_ - waited);
+    return frame;
+}
+
+AVFrame *InputVideoFile::DecodeNextFrame()
+{
+    if (pastRange_)
+    {
+        lastError_ = AVERROR_EOF;
+        return nullptr;
+    }
     if (draining_)
         return GetNextDrainFrame();
 
     lastError_ = AVERROR(EAGAIN);
     while (lastError_ == AVERROR(EAGAIN))
     {
-        lastError_ = av_read_frame(formatContext_, packet_);
+        lastError_ = ReadPacket(packet_);
         if (lastError_ >= 0)
         {
             if (packet_->stream_index == videoStreamIndex_)
@@ -127,34 +233,40 @@ AVFrame *InputVideoFile::GetNextFrame()
                 lastError_ = avcodec_send_packet(videoCodecContext_, packet_);
                 if (lastError_ < 0)
                 {
-                    outputStream_ << "*** Error sending video packet to decoder: " << GetErrorString(lastError_) << endl;
+                    Locked(outputStream_) << "*** Error sending video packet to decoder: " << GetErrorString(lastError_) << endl;
                     return nullptr;
                 }
                 lastError_ = avcodec_receive_frame(videoCodecContext_, frame_);
                 if (lastError_ < 0 && lastError_ != AVERROR(EAGAIN))
                 {
-                    outputStream_ << "*** Error getting video frame from decoder: " << GetErrorString(lastError_) << endl;
+                    Locked(outputStream_) << "*** Error getting video frame from decoder: " << GetErrorString(lastError_) << endl;
                     return nullptr;
                 }
-            }
-            else if (packet_->stream_index == audioStreamIndex_)
-            {
-                lastError_ = avcodec_send_packet(audioCodecContext_, packet_);
-                if (lastError_ < 0)
+                if (lastError_ >= 0 && CompareToRange(frame_) < 0)
                 {
-                    outputStream_ << "*** Error sending audio packet to decoder" << GetErrorString(lastError_) << endl;
-                    return nullptr;
+                    av_frame_unref(frame_);
+                    lastError_ = AVERROR(EAGAIN);
                 }
-                lastError_ = avcodec_receive_frame(audioCodecContext_, frame_);
-                if (lastError_ < 0 && lastError_ != AVERROR(EAGAIN))
+                else if (lastError_ >= 0 && CompareToRange(frame_) > 0)
                 {
-                    outputStream_ << "*** Error getting audio frame from decoder: " << GetErrorString(lastError_) << endl;
+                    // Frames come out of the decoder in presentation order, so everything in range has been had
+                    av_frame_unref(frame_);
+                    av_packet_unref(packet_);
+                    pastRange_ = true;
+                    lastError_ = AVERROR_EOF;
+                    StopReadAhead(); // there's nothing more it could read that's wanted
                     return nullptr;
                 }
             }
+            else if (packet_->stream_index == audioStreamIndex_ && audioMode_ != AudioMode::None && audioPacketHandler_)
+            {
+                // Handed over as is, the handler takes what it wants from the packet
+                audioPacketHandler_(packet_);
+                lastError_ = AVERROR(EAGAIN);
+            }
             else
             {
-                // Some wacky stream (GoPro has a 3rd stream for data, for example ...)
+                // Some wacky stream (GoPro has a 3rd stream for data, for example ...), or audio we don't want.
                 // Discard it.
                 lastError_ = AVERROR(EAGAIN);
             }
@@ -164,8 +276,6 @@ AVFrame *InputVideoFile::GetNextFrame()
             // Begin draining
             draining_ = true;
             lastError_ = avcodec_send_packet(videoCodecContext_, nullptr);
-            if (audioCodecContext_ != nullptr)
-                lastError_ = avcodec_send_packet(audioCodecContext_, nullptr);
             return GetNextDrainFrame();
         }
         av_packet_unref(packet_);
@@ -177,22 +287,283 @@ AVFrame *InputVideoFile::GetNextFrame()
 AVFrame *InputVideoFile::GetNextDrainFrame()
 {
     lastError_ = avcodec_receive_frame(videoCodecContext_, frame_);
+    while (lastError_ >= 0 && CompareToRange(frame_) < 0)
+    {
+        av_frame_unref(frame_);
+        lastError_ = avcodec_receive_frame(videoCodecContext_, frame_);
+    }
+    if (lastError_ >= 0 && CompareToRange(frame_) > 0)
+    {
+        av_frame_unref(frame_);
+        pastRange_ = true;
+        lastError_ = AVERROR_EOF;
+        return nullptr;
+    }
     if (lastError_ != AVERROR_EOF)
         return frame_;
-    if (audioCodecContext_ != nullptr)
+    return nullptr;
+}
+
+void InputVideoFile::SetAudioMode(AudioMode mode, function<void(AVPacket *)> packetHandler)
+{
+    audioMode_ = mode;
+    audioPacketHandler_ = packetHandler;
+}
+
+int InputVideoFile::GetKeyframes(vector<int64_t>& keyframes)
+{
+    keyframes.clear();
+    lastError_ = GetIndexedKeyframes(keyframes);
+    if (lastError_ >= 0 && keyframes.empty())
+        lastError_ = ScanKeyframes(keyframes);
+    if (lastError_ < 0)
+        return lastError_;
+    sort(keyframes.begin(), keyframes.end());
+
+    lastError_ = av_seek_frame(formatContext_, videoStreamIndex_, keyframes.empty() ? 0 : keyframes.front(), AVSEEK_FLAG_BACKWARD);
+    if (lastError_ < 0)
+        Locked(outputStream_) << "Could not go back to the start after finding keyframes: " << GetErrorString(lastError_) << endl;
+    return lastError_ < 0 ? lastError_ : 0;
+}
+
+int InputVideoFile::GetIndexedKeyframes(vector<int64_t>& keyframes)
+{
+    AVStream *stream = formatContext_->streams[videoStreamIndex_];
+    int count = avformat_index_get_entries_count(stream);
+    if (count == 0)
+        return 0;
+
+    // Some demuxers index by decode timestamp (mp4) and some by presentation (matroska). The first packet says
+    // how far apart the two are, and keyframes are usually the same distance apart throughout. If they aren't,
+    // a segment only starts a frame or two off its keyframe, as the segments still meet without a gap.
+    int64_t shift = 0;
+    int result = 0;
+    while ((result = av_read_frame(formatContext_, packet_)) >= 0 && packet_->stream_index != videoStreamIndex_)
+        av_packet_unref(packet_);
+    if (result < 0 && result != AVERROR_EOF)
     {
-        lastError_ = avcodec_receive_frame(audioCodecContext_, frame_);
-        if (lastError_ != AVERROR_EOF)
-            return frame_;
+        Locked(outputStream_) << "Could not read the first frame for the keyframes: " << GetErrorString(result) << endl;
+        return result;
     }
-    return nullptr;
+    const AVIndexEntry *first = avformat_index_get_entry(stream, 0);
+    if (result >= 0 && packet_->pts != AV_NOPTS_VALUE && first != nullptr)
+        shift = packet_->pts - first->timestamp;
+    av_packet_unref(packet_);
+
+    for (int i = 0; i < count; i++)
+    {
+        const AVIndexEntry *entry = avformat_index_get_entry(stream, i);
+        if (entry != nullptr && (entry->flags & AVINDEX_KEYFRAME) != 0 && (entry->flags & AVINDEX_DISCARD_FRAME) == 0)
+            keyframes.push_back(entry->timestamp + shift);
+    }
+    return 0;
+}
+
+int InputVideoFile::ScanKeyframes(vector<int64_t>& keyframes)
+{
+    // The packets say which are keyframes without anything having to be decoded
+    int result = 0;
+    while ((result = av_read_frame(formatContext_, packet_)) >= 0)
+    {
+        if (packet_->stream_index == videoStreamIndex_ && (packet_->flags & AV_PKT_FLAG_KEY) != 0)
+            keyframes.push_back(packet_->pts != AV_NOPTS_VALUE ? packet_->pts : packet_->dts);
+        av_packet_unref(packet_);
+    }
+    if (result != AVERROR_EOF)
+    {
+        Locked(outputStream_) << "Could not read through for the keyframes: " << GetErrorString(result) << endl;
+        return result;
+    }
+    return 0;
+}
+
+bool InputVideoFile::SetThreadPool(ThreadPool& pool)
+{
+    return ShareThreadPool(videoCodecContext_, videoCallbacks_, pool);
+}
+
+bool InputVideoFile::SetBandHandler(function<void(const AVFrame *, int, int)> handler)
+{
+    if (videoCodecContext_ == nullptr)
+        return false;
+
+    videoCodecContext_->draw_horiz_band = nullptr;
+    videoCallbacks_.drawBand = nullptr;
+    if (!handler || !(videoCodecContext_->codec->capabilities & AV_CODEC_CAP_DRAW_HORIZ_BAND) || (videoCodecContext_->active_thread_type & FF_THREAD_FRAME))
+        return false;
+
+    videoCallbacks_.drawBand = handler;
+    videoCodecContext_->draw_horiz_band = &DrawBand;
+    return true;
+}
+
+void InputVideoFile::SetReadAhead(size_t bytes)
+{
+    readAheadBytes_ = bytes;
+}
+
+DemuxStats InputVideoFile::GetDemuxStats() const
+{
+    DemuxStats stats;
+    stats.readTime = chrono::nanoseconds(readNanoseconds_.load(memory_order_relaxed));
+    stats.waitTime = chrono::nanoseconds(waitNanoseconds_);
+    stats.decodeTime = chrono::nanoseconds(decodeNanoseconds_);
+    stats.peakBytes = readBudget_ != nullptr ? readBudget_->GetPeak() : 0;
+    return stats;
+}
+
+int InputVideoFile::ReadPacket(AVPacket *packet)
+{
+    auto started = chrono::steady_clock::now();
+    int result = 0;
+    if (readAheadBytes_ == 0)
+    {
+        result = av_read_frame(formatContext_, packet);
+        readNanoseconds_.fetch_add((chrono::steady_clock::now() - started).count(), memory_order_relaxed);
+    }
+    else
+    {
+        // From here on the read thread is the only one touching the format context
+        if (!readThread_.joinable() && !readStopping_)
+        {
+            readBudget_.reset(new MemoryBudget(readAheadBytes_));
+            for (size_t i = 0; i < ReadAheadPackets; i++)
+            {
+                readPackets_.push_back(av_packet_alloc());
+                freeReadPackets_.Push(readPackets_.back());
+            }
+            AllocationCounter::Record(ReadAheadPackets * sizeof(AVPacket));
+            readThread_ = thread(&InputVideoFile::ReadThreadEntry, this);
+        }
+
+        // Takes the queued packet's reference, so it can go straight back to be read into again
+        AVPacket *queued = nullptr;
+        if (readQueue_.Pop(queued))
+        {
+            uint64_t size = static_cast<uint64_t>(queued->size);
+            av_packet_move_ref(packet, queued);
+            freeReadPackets_.Push(queued);
+            readBudget_->Release(size);
+        }
+        else
+            result = readError_;
+    }
+    waitNanoseconds_ += (chrono::steady_clock::now() - started).count();
+    return result;
+}
+
+void InputVideoFile::ReadThreadEntry()
+{
+    AVPacket *packet = nullptr;
+    while (!readStopping_ && freeReadPackets_.Pop(packet))
+    {
+        int result = AVERROR(EAGAIN);
+        while (result == AVERROR(EAGAIN) && !readStopping_)
+        {
+            auto started = chrono::steady_clock::now();
+            result = av_read_frame(formatContext_, packet);
+            readNanoseconds_.fetch_add((chrono::steady_clock::now() - started).count(), memory_order_relaxed);
+        }
+        if (result < 0)
+        {
+            // The end of the file, or an error, comes out of ReadPacket once everything before it has
+            readError_ = result;
+            readQueue_.Close();
+            return;
+        }
+
+        // Waits here while the decoder is a budget's worth behind
+        readBudget_->Acquire(static_cast<uint64_t>(packet->size));
+        readQueue_.Push(packet);
+    }
+}
+
+void InputVideoFile::StopReadAhead()
+{
+    readStopping_ = true;
+    if (readThread_.joinable())
+    {
+        // Throwing away what's been read ahead gets the thread out of the budget if it's waiting there, and
+        // then it's got nothing left to read into. Anything it queued on the way out goes after it's finished.
+        freeReadPackets_.Close();
+        DiscardReadAhead();
+        readThread_.join();
+        DiscardReadAhead();
+    }
+
+    // Anything that asks for another packet is told the file's finished
+    if (readError_ == 0)
+        readError_ = AVERROR_EOF;
+    readQueue_.Close();
+}
+
+void InputVideoFile::DiscardReadAhead()
+{
+    AVPacket *packet = nullptr;
+    while (readQueue_.TryPop(packet))
+    {
+        readBudget_->Release(static_cast<uint64_t>(packet->size));
+        av_packet_unref(packet);
+    }
+}
+
+int InputVideoFile::SetRange(int64_t start, int64_t end)
+{
+    rangeStart_ = start;
+    rangeEnd_ = end;
+    if (start == AV_NOPTS_VALUE)
+        return 0;
+
+    // Backwards, so the worst that can happen is a few frames before start get decoded and thrown away
+    lastError_ = av_seek_frame(formatContext_, videoStreamIndex_, start, AVSEEK_FLAG_BACKWARD);
+    if (lastError_ < 0)
+    {
+        Locked(outputStream_) << "Could not seek to " << start << ": " << GetErrorString(lastError_) << endl;
+        return lastError_;
+    }
+    avcodec_flush_buffers(videoCodecContext_);
+    if (audioCodecContext_ != nullptr)
+        avcodec_flush_buffers(audioCodecContext_);
+    return 0;
+}
+
+int InputVideoFile::CompareToRange(const AVFrame *frame) const
+{
+    int64_t timestamp = frame->best_effort_timestamp;
+    if (timestamp == AV_NOPTS_VALUE)
+        return 0;
+    if (rangeStart_ != AV_NOPTS_VALUE && timestamp < rangeStart_)
+        return -1;
+    if (rangeEnd_ != AV_NOPTS_VALUE && timestamp >= rangeEnd_)
+        return 1;
+    return 0;
+}
+
+int InputVideoFile::SendAudioPacket(AVPacket *packet)
+{
+    int result = avcodec_send_packet(audioCodecContext_, packet);
+    if (result < 0 && result != AVERROR(EAGAIN) && result != AVERROR_EOF)
+        Locked(outputStream_) << "*** Error sending audio packet to decoder: " << GetErrorString(result) << endl;
+    return result;
+}
+
+int InputVideoFile::ReceiveAudioFrame(AVFrame *frame)
+{
+    int result = avcodec_receive_frame(audioCodecContext_, frame);
+    if (result < 0 && result != AVERROR(EAGAIN) && result != AVERROR_EOF)
+        Locked(outputStream_) << "*** Error getting audio frame from decoder: " << GetErrorString(result) << endl;
+    return result;
 }
 
 VideoInfo InputVideoFile::GetVideoInfo()
 {
-    VideoInfo v;
+    VideoInfo v = VideoInfo();
+    v.audioMode = AudioMode::None;
     if (audioCodecContext_ != nullptr)
     {
+        v.audioMode = AudioMode::Encode;
+        v.audioCodecParameters = formatContext_->streams[audioStreamIndex_]->codecpar;
+        v.audioStreamTimeBase = formatContext_->streams[audioStreamIndex_]->time_base;
         v.audioBitRate = audioCodecContext_->bit_rate;
         v.audioChannels = audioCodecContext_->ch_layout.nb_channels;
         v.audioChannelLayout = audioCodecContext_->ch_layout;
@@ -211,18 +582,27 @@ VideoInfo InputVideoFile::GetVideoInfo()
     return v;
 }
 
-OutputVideoFile::OutputVideoFile(string filename, VideoInfo sourceInfo, ostream& outputStream) :
+OutputVideoFile::OutputVideoFile(string filename, VideoInfo sourceInfo, ostream& outputStream, size_t ioBufferSize) :
     filename_(filename),
     outputStream_(outputStream),
+    videoCallbacks_({ nullptr, nullptr, nullptr, 0 }),
+    file_(nullptr), freeMuxPackets_(MuxQueueDepth), muxQueue_(MuxQueueDepth), muxError_(0), muxedVideoFrames_(0), progress_(nullptr),
     formatContext_(nullptr), videoCodecContext_(nullptr), audioCodecContext_(nullptr),
     videoStream_(nullptr), audioStream_(nullptr),
+    audioSourceTimeBase_(sourceInfo.audioStreamTimeBase),
     audioResampleContext_(nullptr),
-    videoFrameCount_(0), audioFrameCount_(0), lastError_(0)
+    packet_(nullptr), audioPacket_(nullptr), conversionFrame_(nullptr), conversionSamples_(0),
+    videoFrameCount_(0), audioFrameCount_(0), lastError_(0), trailerWritten_(false)
 {
+    packet_ = av_packet_alloc();
+    audioPacket_ = av_packet_alloc();
+    conversionFrame_ = av_frame_alloc();
+    AllocationCounter::Record(2 * sizeof(AVPacket) + sizeof(AVFrame));
+
     lastError_ = avformat_alloc_output_context2(&formatContext_, nullptr, nullptr, filename.c_str());
     if (lastError_ < 0 || formatContext_ == nullptr)
     {
-        outputStream_ << "Could not create format context: " << GetErrorString(lastError_) << endl;
+        Locked(outputStream_) << "Could not create format context: " << GetErrorString(lastError_) << endl;
         return;
     }
 
@@ -230,7 +610,9 @@ OutputVideoFile::OutputVideoFile(string filename, VideoInfo sourceInfo, ostream&
     videoCodecContext_ = avcodec_alloc_context3(videoCodec);
     videoStream_ = avformat_new_stream(formatContext_, videoCodec);
 
-    videoCodecContext_->profile = FF_PROFILE_H264_HIGH;
+    // High profile only covers 8 bit 4:2:0, let the encoder pick for anything else
+    if (sourceInfo.pixelFormat == AV_PIX_FMT_YUV420P || sourceInfo.pixelFormat == AV_PIX_FMT_YUVJ420P)
+        videoCodecContext_->profile = FF_PROFILE_H264_HIGH;
     videoCodecContext_->bit_rate = sourceInfo.bitRate;
     videoCodecContext_->width = sourceInfo.width;
     videoCodecContext_->height = sourceInfo.height;
@@ -241,6 +623,8 @@ OutputVideoFile::OutputVideoFile(string filename, VideoInfo sourceInfo, ostream&
     videoStream_->r_frame_rate = sourceInfo.frameRate;
 
     videoCodecContext_->time_base = av_inv_q(sourceInfo.frameRate);
+    if (sourceInfo.encoderThreads > 0)
+        videoCodecContext_->thread_count = sourceInfo.encoderThreads;
     //videoStream_->time_base = videoCodecContext_->time_base;
     //videoCodecContext_->time_base = sourceInfo.videoTimeBase;
     //videoStream_->time_base = sourceInfo.streamTimeBase;
@@ -252,7 +636,7 @@ OutputVideoFile::OutputVideoFile(string filename, VideoInfo sourceInfo, ostream&
     lastError_ = avcodec_open2(videoCodecContext_, videoCodec, &opt);
     if (lastError_ < 0)
     {
-        outputStream_ << "Error creating video codec" << endl;
+        Locked(outputStream_) << "Error creating video codec" << endl;
         return;
     }
     av_dict_free(&opt);
@@ -261,7 +645,17 @@ OutputVideoFile::OutputVideoFile(string filename, VideoInfo sourceInfo, ostream&
     if (lastError_ < 0)
         return;
 
-    if (sourceInfo.audioChannels > 0)
+    if (sourceInfo.audioMode == AudioMode::Copy)
+    {
+        // No encoder, the stream just describes what's in the source's packets
+        audioStream_ = avformat_new_stream(formatContext_, nullptr);
+        lastError_ = avcodec_parameters_copy(audioStream_->codecpar, sourceInfo.audioCodecParameters);
+        if (lastError_ < 0)
+            return;
+        audioStream_->codecpar->codec_tag = 0; // let the muxer pick the tag for its own container
+        audioStream_->time_base = sourceInfo.audioStreamTimeBase;
+    }
+    else if (sourceInfo.audioMode == AudioMode::Encode && sourceInfo.audioChannels > 0)
     {
         const AVCodec* audioCodec = avcodec_find_encoder(formatContext_->oformat->audio_codec);
         audioCodecContext_ = avcodec_alloc_context3(audioCodec);
@@ -281,7 +675,7 @@ OutputVideoFile::OutputVideoFile(string filename, VideoInfo sourceInfo, ostream&
         lastError_ = avcodec_open2(audioCodecContext_, audioCodec, &opt);
         if (lastError_ < 0)
         {
-            outputStream_ << "Error creating audio codec" << endl;
+            Locked(outputStream_) << "Error creating audio codec" << endl;
             return;
         }
         av_dict_free(&opt);
@@ -293,17 +687,33 @@ OutputVideoFile::OutputVideoFile(string filename, VideoInfo sourceInfo, ostream&
 
     av_dump_format(formatContext_, 0, filename.c_str(), 1);
 
-    lastError_ = avio_open(&formatContext_->pb, filename.c_str(), AVIO_FLAG_WRITE);
-    if (lastError_ < 0)
+    // Our own AVIOContext rather than avio_open, so it gets a buffer big enough to keep writes to slow storage
+    // few and large
+    file_ = OpenUtf8(filename, "wb");
+    unsigned char *ioBuffer = file_ != nullptr ? static_cast<unsigned char *>(av_malloc(ioBufferSize)) : nullptr;
+    if (ioBuffer != nullptr)
+        formatContext_->pb = avio_alloc_context(ioBuffer, static_cast<int>(ioBufferSize), 1, file_, nullptr, &OutputVideoFile::WriteFile, &OutputVideoFile::SeekFile);
+    if (formatContext_->pb == nullptr)
     {
-        outputStream_ << "Error opening output file" << endl;
+        av_free(ioBuffer);
+        lastError_ = file_ == nullptr ? AVERROR(errno) : AVERROR(ENOMEM);
+        Locked(outputStream_) << "Error opening output file" << endl;
         return;
     }
     lastError_ = avformat_write_header(formatContext_, &opt);
     if (lastError_ < 0)
     {
-        outputStream_ << "Could not write container header: " << GetErrorString(lastError_) << endl;
+        Locked(outputStream_) << "Could not write container header: " << GetErrorString(lastError_) << endl;
+    }
+
+    // The header's out of the way, from here on the mux thread is the only one touching the format context
+    for (size_t i = 0; i < MuxQueueDepth; i++)
+    {
+        muxPackets_.push_back(av_packet_alloc());
+        freeMuxPackets_.Push(muxPackets_.back());
     }
+    AllocationCounter::Record(MuxQueueDepth * sizeof(AVPacket) + ioBufferSize);
+    muxThread_ = thread(&OutputVideoFile::MuxThreadEntry, this);
 
     // Create audio resampler, if needed
     if (audioCodecContext_ != nullptr)
@@ -324,7 +734,7 @@ OutputVideoFile::OutputVideoFile(string filename, VideoInfo sourceInfo, ostream&
             lastError_ = swr_init(audioResampleContext_);
             if (lastError_ < 0)
             {
-                outputStream_ << "Could not set up audio format resampling: " << GetErrorString(lastError_) << endl;
+                Locked(outputStream_) << "Could not set up audio format resampling: " << GetErrorString(lastError_) << endl;
             }
         }
     }
@@ -332,135 +742,278 @@ OutputVideoFile::OutputVideoFile(string filename, VideoInfo sourceInfo, ostream&
 
 OutputVideoFile::~OutputVideoFile()
 {
+    // Without a Flush, whatever made it to the muxer still gets a trailer so the file plays
+    StopMuxThread();
+    for (auto packet : muxPackets_)
+        av_packet_free(&packet);
+
     if (formatContext_->pb != nullptr)
     {
-        av_write_trailer(formatContext_);
-        avio_closep(&formatContext_->pb);
+        WriteTrailer();
+        av_freep(&formatContext_->pb->buffer);
+        avio_context_free(&formatContext_->pb);
     }
+    if (file_ != nullptr)
+        fclose(file_);
 
     if (audioResampleContext_ != nullptr)
     {
         swr_free(&audioResampleContext_);
     }
 
+    av_packet_free(&packet_);
+    av_packet_free(&audioPacket_);
+    av_frame_free(&conversionFrame_);
     avcodec_free_context(&videoCodecContext_);
     avcodec_free_context(&audioCodecContext_);
     avformat_free_context(formatContext_);
 }
 
-int OutputVideoFile::WriteNextFrame(AVFrame *frame)
+bool OutputVideoFile::SetThreadPool(ThreadPool& pool)
 {
-    AVCodecContext *codec = nullptr;
-    AVStream *stream = nullptr;
-    AVFrame *conversionFrame = nullptr;
+    return ShareThreadPool(videoCodecContext_, videoCallbacks_, pool);
+}
 
-    if (frame->width == 0)
+int OutputVideoFile::GetWritableVideoFrame(AVFrame *frame)
+{
+    frame->width = videoCodecContext_->width;
+    frame->height = videoCodecContext_->height;
+    frame->format = videoCodecContext_->pix_fmt;
+
+    // Doesn't touch lastError_, so this can be called from a different thread to the one writing frames
+    int linesizeAlign[AV_NUM_DATA_POINTERS] = { 0 }; // the pool's own alignment is plenty for the encoder
+    int result = framePool_.GetFrameBuffer(frame, frame->width, frame->height, linesizeAlign);
+    if (result < 0)
+        Locked(outputStream_) << "Could not get a frame buffer for the encoder: " << GetErrorString(result) << endl;
+    return result;
+}
+
+int OutputVideoFile::WriteNextFrame(AVFrame *frame)
+{
+    // Once the mux thread has failed nothing more can be written, so there's no point encoding it
+    if (muxError_ < 0)
     {
-        codec = audioCodecContext_;
-        stream = audioStream_;
-        //frame->pts = av_rescale_q(frame->pts, AVRational { 1, audioCodecContext_->sample_rate }, audioCodecContext_->time_base);
-        //frame->pts = audioFrameCount_;
-        audioFrameCount_++;
+        lastError_ = muxError_;
+        return lastError_;
+    }
 
-        if (audioResampleContext_ != nullptr)
-        {
-            // the source layout may be 0. 0 is invalid input for the resampler. If we then pass
-            // 0 in here, it complains that the format is incorrect, so we lie at both ends
-            av_channel_layout_default(&frame->ch_layout, audioCodecContext_->ch_layout.nb_channels);
+    //frame->pts = videoFrameCount_;
+    frame->pts = videoCodecContext_->frame_number;
+    videoFrameCount_++;
 
-            conversionFrame = av_frame_alloc();
-            conversionFrame->ch_layout = audioCodecContext_->ch_layout;
-            conversionFrame->sample_rate = audioCodecContext_->sample_rate;
-            conversionFrame->format = audioCodecContext_->sample_fmt;
-            conversionFrame->pts = frame->pts;
+    int result = EncodeFrame(videoCodecContext_, videoStream_, frame, packet_);
+    if (result < 0)
+        lastError_ = result;
+    return result;
+}
 
-            lastError_ = swr_convert_frame(audioResampleContext_, conversionFrame, frame);
-            if (lastError_ < 0)
-            {
-                outputStream_ << "Could not resample audio frame: " << GetErrorString(lastError_) << endl;
-                return lastError_;
-            }
+int OutputVideoFile::WriteAudioFrame(AVFrame *frame)
+{
+    //frame->pts = av_rescale_q(frame->pts, AVRational { 1, audioCodecContext_->sample_rate }, audioCodecContext_->time_base);
+    //frame->pts = audioFrameCount_;
+    audioFrameCount_++;
+
+    if (audioResampleContext_ == nullptr)
+        return EncodeFrame(audioCodecContext_, audioStream_, frame, audioPacket_);
+
+    // the source layout may be 0. 0 is invalid input for the resampler. If we then pass
+    // 0 in here, it complains that the format is incorrect, so we lie at both ends
+    av_channel_layout_default(&frame->ch_layout, audioCodecContext_->ch_layout.nb_channels);
+
+    // Hang on to the last frame's buffers if they're big enough and the encoder has let go of them
+    AVFrame *conversionFrame = conversionFrame_;
+    int samples = swr_get_out_samples(audioResampleContext_, frame->nb_samples);
+    int result = 0;
+    if (conversionFrame->buf[0] == nullptr || !av_frame_is_writable(conversionFrame) || samples > conversionSamples_)
+    {
+        av_frame_unref(conversionFrame);
+        conversionFrame->ch_layout = audioCodecContext_->ch_layout;
+        conversionFrame->sample_rate = audioCodecContext_->sample_rate;
+        conversionFrame->format = audioCodecContext_->sample_fmt;
+        conversionFrame->nb_samples = samples;
+        result = av_frame_get_buffer(conversionFrame, 0);
+        if (result < 0)
+        {
+            Locked(outputStream_) << "Could not allocate audio resampling buffer: " << GetErrorString(result) << endl;
+            return result;
         }
+        conversionSamples_ = samples;
+        AllocationCounter::Record(av_samples_get_buffer_size(nullptr, conversionFrame->ch_layout.nb_channels, samples, audioCodecContext_->sample_fmt, 0));
     }
-    else
+    conversionFrame->nb_samples = conversionSamples_; // room available, the resampler sets how much it used
+    conversionFrame->pts = frame->pts;
+
+    result = swr_convert_frame(audioResampleContext_, conversionFrame, frame);
+    if (result < 0)
     {
-        codec = videoCodecContext_;
-        stream = videoStream_;
-        //frame->pts = videoFrameCount_;
-        frame->pts = videoCodecContext_->frame_number;
-        videoFrameCount_++;
+        Locked(outputStream_) << "Could not resample audio frame: " << GetErrorString(result) << endl;
+        return result;
     }
 
-    if (conversionFrame != nullptr)
-        lastError_ = avcodec_send_frame(codec, conversionFrame);
-    else
-        lastError_ = avcodec_send_frame(codec, frame);
+    return EncodeFrame(audioCodecContext_, audioStream_, conversionFrame, audioPacket_);
+}
 
-    if (lastError_ < 0 && lastError_ != AVERROR(EAGAIN) && lastError_ != AVERROR_EOF)
+int OutputVideoFile::EncodeFrame(AVCodecContext *codec, AVStream *stream, AVFrame *frame, AVPacket *packet)
+{
+    int result = avcodec_send_frame(codec, frame);
+    if (result < 0 && result != AVERROR(EAGAIN) && result != AVERROR_EOF)
     {
-        outputStream_ << "Could not send frame to encoder: " << GetErrorString(lastError_) << endl;
-        return lastError_;
+        Locked(outputStream_) << "Could not send frame to encoder: " << GetErrorString(result) << endl;
+        return result;
     }
 
-    AVPacket* packet = av_packet_alloc();
-
+    // A null frame drains the encoder, which says EOF once it's empty
     int packetCount = 0;
-    lastError_ = avcodec_receive_packet(codec, packet);
-    while (lastError_ != AVERROR(EAGAIN))
+    result = avcodec_receive_packet(codec, packet);
+    while (result != AVERROR(EAGAIN) && result != AVERROR_EOF)
     {
-        if (lastError_ < 0)
+        if (result < 0)
         {
-            outputStream_ << "Unable to encode packet: " << GetErrorString(lastError_) << endl;
-            return lastError_;
+            Locked(outputStream_) << "Unable to encode packet: " << GetErrorString(result) << endl;
+            return result;
         }
         av_packet_rescale_ts(packet, codec->time_base, stream->time_base);
         packet->stream_index = stream->index;
-        lastError_ = av_interleaved_write_frame(formatContext_, packet);
+        result = QueuePacket(packet);
+        if (result < 0)
+            return result;
         packetCount ++;
-        lastError_ = avcodec_receive_packet(codec, packet);
+        result = avcodec_receive_packet(codec, packet);
     }
 
-    // If we had to cook the books on audio frames, make sure we clean up after ourselves
-    if (conversionFrame != nullptr)
-    {
-        av_frame_free(&conversionFrame);
-    }
+    return packetCount;
+}
 
-    av_packet_free(&packet);
+int OutputVideoFile::Flush()
+{
+    // What's left in the encoders goes to the mux thread, which then writes everything out before the trailer
+    int result = EncodeFrame(videoCodecContext_, videoStream_, nullptr, packet_);
+    if (result >= 0 && audioCodecContext_ != nullptr)
+        result = EncodeFrame(audioCodecContext_, audioStream_, nullptr, audioPacket_);
 
-    return packetCount;
+    int closed = Close();
+    if (result < 0)
+        lastError_ = result;
+    return result < 0 ? result : closed;
 }
 
-void OutputVideoFile::Flush()
+int OutputVideoFile::Close()
 {
-    auto packet = av_packet_alloc();
+    StopMuxThread();
+    int result = muxError_;
+    if (result >= 0)
+        result = WriteTrailer();
+
+    if (result < 0)
+        lastError_ = result;
+    return result < 0 ? result : 0;
+}
 
-    // Flush video
-    avcodec_send_frame(videoCodecContext_, nullptr);
-    lastError_ = avcodec_receive_packet(videoCodecContext_, packet);
-    while (lastError_ != AVERROR_EOF)
+void OutputVideoFile::StopMuxThread()
+{
+    muxQueue_.Close();
+    if (muxThread_.joinable())
+        muxThread_.join();
+}
+
+int OutputVideoFile::WriteTrailer()
+{
+    if (trailerWritten_ || formatContext_->pb == nullptr)
+        return 0;
+    trailerWritten_ = true;
+
+    // The file's written through stdio's buffer as well as libav's, and either can be holding the error
+    int result = av_write_trailer(formatContext_);
+    avio_flush(formatContext_->pb);
+    if (result >= 0 && formatContext_->pb->error < 0)
+        result = formatContext_->pb->error;
+    if (result >= 0 && file_ != nullptr && fflush(file_) != 0)
+        result = AVERROR(errno);
+    if (result < 0)
+        Locked(outputStream_) << "Could not finish writing '" << filename_ << "': " << GetErrorString(result) << endl;
+    return result;
+}
+
+int OutputVideoFile::WriteAudioPacket(AVPacket *packet)
+{
+    // Doesn't touch lastError_, for the same reason as GetWritableVideoFrame. The stream's time base is whatever
+    // the muxer settled on when it wrote the header, and doesn't change after that.
+    av_packet_rescale_ts(packet, audioSourceTimeBase_, audioStream_->time_base);
+    packet->stream_index = audioStream_->index;
+    packet->pos = -1;
+    return QueuePacket(packet);
+}
+
+bool OutputVideoFile::CanCopyAudio(const string& filename, AVCodecID codec)
+{
+    const AVOutputFormat *format = av_guess_format(nullptr, filename.c_str(), nullptr);
+    return format != nullptr && avformat_query_codec(format, codec, FF_COMPLIANCE_NORMAL) == 1;
+}
+
+int OutputVideoFile::QueuePacket(AVPacket *packet)
+{
+    // Hand the packet's data over to one of the mux thread's packets, waiting for one to come free if the
+    // thread is a full queue behind
+    AVPacket *queued = nullptr;
+    if (muxError_ < 0 || !freeMuxPackets_.Pop(queued))
     {
-        av_packet_rescale_ts(packet, videoCodecContext_->time_base, videoStream_->time_base);
-        packet->stream_index = videoStream_->index;
-        lastError_ = av_interleaved_write_frame(formatContext_, packet);
-        lastError_ = avcodec_receive_packet(videoCodecContext_, packet);
+        av_packet_unref(packet);
+        return muxError_ < 0 ? static_cast<int>(muxError_) : AVERROR(EPIPE);
     }
+    av_packet_move_ref(queued, packet);
+    muxQueue_.Push(queued);
+    return 0;
+}
 
-    // Flush audio
-    if (audioCodecContext_ != nullptr)
+void OutputVideoFile::MuxThreadEntry()
+{
+    AVPacket *packet = nullptr;
+    while (muxQueue_.Pop(packet))
     {
-        avcodec_send_frame(audioCodecContext_, nullptr);
-        lastError_ = avcodec_receive_packet(audioCodecContext_, packet);
-        while (lastError_ != AVERROR_EOF)
+        // Takes the packet's reference, whether it works or not
+        int size = packet->size;
+        bool video = packet->stream_index == videoStream_->index;
+        int result = av_interleaved_write_frame(formatContext_, packet);
+        if (result < 0 && muxError_ == 0)
         {
-            av_packet_rescale_ts(packet, audioCodecContext_->time_base, audioStream_->time_base);
-            packet->stream_index = audioStream_->index;
-            lastError_ = av_interleaved_write_frame(formatContext_, packet);
-            lastError_ = avcodec_receive_packet(audioCodecContext_, packet);
+            muxError_ = result;
+            Locked(outputStream_) << "Could not write packet: " << GetErrorString(result) << endl;
         }
+        else if (result >= 0)
+        {
+            if (video)
+                muxedVideoFrames_.fetch_add(1, memory_order_relaxed);
+            if (progress_ != nullptr)
+                progress_->bytesWritten.fetch_add(size, memory_order_relaxed);
+        }
+        freeMuxPackets_.Push(packet);
     }
+}
 
-    av_packet_free(&packet);
+int OutputVideoFile::WriteFile(void *opaque, uint8_t *buffer, int size)
+{
+    FILE *file = static_cast<FILE *>(opaque);
+    if (fwrite(buffer, 1, size, file) != static_cast<size_t>(size))
+        return AVERROR(errno);
+    return size;
+}
+
+int64_t OutputVideoFile::SeekFile(void *opaque, int64_t offset, int whence)
+{
+    FILE *file = static_cast<FILE *>(opaque);
+    if (whence == AVSEEK_SIZE)
+    {
+        // Size without moving, which stdio can only do by going to the end and back
+        int64_t position = ftello(file);
+        if (fseeko(file, 0, SEEK_END) != 0)
+            return AVERROR(errno);
+        int64_t size = ftello(file);
+        fseeko(file, position, SEEK_SET);
+        return size;
+    }
+    if (fseeko(file, offset, whence & ~AVSEEK_FORCE) != 0)
+        return AVERROR(errno);
+    return ftello(file);
 }
 
 string DerperView::GetErrorString(int errorCode)
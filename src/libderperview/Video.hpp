@@ -1,3 +1,5 @@
+#pragma once
+
 extern "C"
 {
     #include "libavformat/avformat.h"
@@ -7,11 +9,32 @@ extern "C"
     #include "libswresample/swresample.h"
 }
 
+#include "FramePool.hpp"
+#include "BoundedQueue.hpp"
+#include "MemoryBudget.hpp"
+
 #include <string>
 #include <iostream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <cstdio>
+#include <functional>
 
 namespace DerperView
 {
+    struct ProgressCounters;
+    class ThreadPool;
+
+    enum class AudioMode
+    {
+        None, // leave the audio out
+        Encode, // decode it, resample if need be and encode with the output container's usual codec
+        Copy, // pass the source's packets straight through to the output
+    };
+
     struct VideoInfo
     {
         int width;
@@ -29,15 +52,44 @@ namespace DerperView
         AVChannelLayout audioChannelLayout;
         int audioChannels;
         AVSampleFormat audioSampleFormat;
+        AudioMode audioMode;
+        const AVCodecParameters *audioCodecParameters; // belongs to the input file, only good while it's open
+        AVRational audioStreamTimeBase;
+
+        int encoderThreads; // how many threads the video encoder can start, 0 for it to decide
+    };
+
+    // What a codec context's opaque points at, for the callbacks we give libavcodec
+    struct CodecCallbackData
+    {
+        FramePool *framePool; // where get_buffer2 gets frame buffers from, if it's ours
+        ThreadPool *threadPool; // where execute runs slice jobs, if it's ours
+        std::function<void(const AVFrame *, int, int)> drawBand; // given rows of a picture as they're final, if anyone wants them
+        int64_t executeCalls; // times the codec has run slice jobs on threadPool. Only the thread driving the codec touches it.
+    };
+
+    // Where an input file's time has gone, to tell a slow disk from a slow decoder
+    struct DemuxStats
+    {
+        std::chrono::nanoseconds readTime; // in av_read_frame, on whichever thread does the reading
+        std::chrono::nanoseconds waitTime; // GetNextFrame waiting for packets, which is all of readTime when nothing's read ahead
+        std::chrono::nanoseconds decodeTime; // the rest of GetNextFrame, which is mostly the decoders
+        uint64_t peakBytes; // most that was read ahead at once
     };
 
     class InputVideoFile
     {
     public:
-        InputVideoFile(std::string filename, std::ostream &outputStream = std::cout);
+        // With useHugePages the decoder's frame buffers are backed by huge pages where the OS will give us them.
+        // decoderThreads is how many threads the video decoder runs of its own (0 for libav to pick), and
+        // decoderThreadType which of FF_THREAD_FRAME and FF_THREAD_SLICE it can use them for.
+        InputVideoFile(std::string filename, std::ostream &outputStream = std::cout, bool useHugePages = false, int decoderThreads = 1, int decoderThreadType = FF_THREAD_FRAME | FF_THREAD_SLICE);
         virtual ~InputVideoFile();
 
         void Dump();
+
+        // The frame returned belongs to InputVideoFile and is only good until the next call. It's reference
+        // counted, so av_frame_ref or av_frame_move_ref it to hang on to the decoder's buffers without copying.
         AVFrame *GetNextFrame();
         AVFrame *GetNextDrainFrame();
         int GetWidth() { return videoCodecContext_->width; }
@@ -47,10 +99,70 @@ namespace DerperView
 
         VideoInfo GetVideoInfo();
         int GetLastError() { return lastError_; }
+        FramePoolStats GetFramePoolStats() const { return framePool_.GetStats(); }
+
+        // What the video decoder ended up with, once libav has had its say: the thread count, and the kind of
+        // threads it's running (0 for none of its own)
+        int GetDecoderThreadCount() const { return videoCodecContext_->thread_count; }
+        int GetDecoderThreadType() const { return videoCodecContext_->active_thread_type; }
+
+        // Only video comes out of GetNextFrame. The audio's packets go to packetHandler as they're read, and with
+        // None or no handler, which is how it starts out, they're thrown away. With Copy they go into the output
+        // as they are, and with Encode they're for decoding elsewhere through SendAudioPacket and
+        // ReceiveAudioFrame, which don't touch anything the video side uses and so can be called from another
+        // thread.
+        void SetAudioMode(AudioMode mode, std::function<void(AVPacket *)> packetHandler = nullptr);
+        int SendAudioPacket(AVPacket *packet);
+        int ReceiveAudioFrame(AVFrame *frame);
+
+        // Fills keyframes with the video keyframes' timestamps, in the video stream's time base. They come from
+        // the demuxer's index where it has one, and only if it's empty is the whole file read through for them.
+        // Either way it's back at the start afterwards. Returns 0 or the error.
+        int GetKeyframes(std::vector<int64_t>& keyframes);
+
+        // Only gives out video frames with timestamps in [start, end), seeking to start first. Either can be
+        // AV_NOPTS_VALUE to leave that end open. start wants to be a keyframe, so nothing before it is needed.
+        int SetRange(int64_t start, int64_t end);
+
+        // Gives the video decoder's slice jobs to pool rather than running them one after another, if libavcodec
+        // isn't running threads of its own for it. Returns whether it did. Call it before reading any frames.
+        // Plenty of decoders never call execute with a single slice context, h264 and hevc included, so whether
+        // the pool was actually used is down to GetPoolExecuteCount.
+        bool SetThreadPool(ThreadPool& pool);
+        int64_t GetPoolExecuteCount() const { return videoCallbacks_.executeCalls; }
+
+        // Has the video decoder call handler with each band of rows of a picture as soon as they're final, along
+        // with the picture they're in, which is the one that comes out of GetNextFrame later with the same
+        // buffers. Bands come top to bottom and pictures in the order they'll come out, though a picture can be
+        // dropped after it's drawn. Only some decoders do this, and not with frame threads, so this returns
+        // whether it's on. nullptr turns it off. Called on the thread that's decoding.
+        bool SetBandHandler(std::function<void(const AVFrame *frame, int firstRow, int rowCount)> handler);
+
+        // Has a thread of its own read packets up to bytes ahead of the decoder, so a slow card reader or network
+        // mount holds up that thread rather than decoding. With 0, which is how it starts out, GetNextFrame reads
+        // them itself as it wants them. Call it before reading any frames, the thread starts with the first one.
+        // After that nothing else can read from or seek the file.
+        void SetReadAhead(size_t bytes);
+        DemuxStats GetDemuxStats() const;
+
+        static const size_t ReadAheadPackets = 1024; // most packets read ahead, however small they are
 
     protected:
+        AVFrame *DecodeNextFrame();
+        int ReadPacket(AVPacket *packet);
+        void ReadThreadEntry();
+        void StopReadAhead();
+        void DiscardReadAhead();
+        int GetIndexedKeyframes(std::vector<int64_t>& keyframes);
+        int ScanKeyframes(std::vector<int64_t>& keyframes);
+
+        // -1 for a frame from before the range, 1 for one from after it, 0 for the rest
+        int CompareToRange(const AVFrame *frame) const;
+
         std::string filename_;
         std::ostream& outputStream_;
+        FramePool framePool_; // where the video decoder gets its frame buffers
+        CodecCallbackData videoCallbacks_;
         AVFormatContext *formatContext_;
         AVCodecContext *videoCodecContext_;
         AVCodecContext *audioCodecContext_;
@@ -58,33 +170,117 @@ namespace DerperView
         int audioStreamIndex_;
         AVPacket *packet_;
         AVFrame *frame_;
+        AudioMode audioMode_;
+        std::function<void(AVPacket *)> audioPacketHandler_;
         bool draining_;
+        int64_t rangeStart_;
+        int64_t rangeEnd_;
+        bool pastRange_;
         int videoFrameCount_;
         int lastError_;
+
+        size_t readAheadBytes_;
+        std::unique_ptr<MemoryBudget> readBudget_; // bytes in packets read but not yet decoded
+        std::vector<AVPacket *> readPackets_;
+        BoundedQueue<AVPacket *> freeReadPackets_;
+        BoundedQueue<AVPacket *> readQueue_; // packets waiting to be decoded, in the order they were read
+        std::thread readThread_;
+        std::atomic<bool> readStopping_;
+        std::atomic<int> readError_; // what stopped the read thread, AVERROR_EOF at the end of the file
+        std::atomic<int64_t> readNanoseconds_;
+        int64_t waitNanoseconds_;
+        int64_t decodeNanoseconds_;
     };
 
     class OutputVideoFile
     {
     public:
-        OutputVideoFile(std::string filename, VideoInfo sourceInfo, std::ostream& outputStream = std::cout);
+        // Encoded packets are written out by a thread of their own through an ioBufferSize byte buffer, so a slow
+        // disk holds up that thread rather than the encoders
+        OutputVideoFile(std::string filename, VideoInfo sourceInfo, std::ostream& outputStream = std::cout, size_t ioBufferSize = DefaultIoBufferSize);
         virtual ~OutputVideoFile();
 
+        // Gives frame writable, reference counted video buffers from a pool sized for the encoder. Writing the
+        // frame hands the encoder its own reference without copying, so just av_frame_unref it afterwards and
+        // the buffers go back to the pool once the encoder is finished with them.
+        int GetWritableVideoFrame(AVFrame *frame);
+
+        // Encodes a video frame and queues its packets for the mux thread, returning how many there were
         int WriteNextFrame(AVFrame *frame);
-        void Flush();
+
+        // Resamples if need be and encodes a decoded audio frame. Only touches the audio side, so it can be called
+        // from a different thread to the one writing video.
+        int WriteAudioFrame(AVFrame *frame);
+
+        // Queues a packet from the source's audio stream to go straight into the output, when the audio mode is
+        // Copy. Can be called from a different thread to WriteNextFrame.
+        int WriteAudioPacket(AVPacket *packet);
+
+        // Whether the container that filename implies can hold audio in this codec as it is
+        static bool CanCopyAudio(const std::string& filename, AVCodecID codec);
+
+        // Drains the encoders, waits for the mux thread to write everything and puts the trailer on. Returns
+        // the first error from any of that, writes that failed on the mux thread included. Nothing can be
+        // written after it.
+        int Flush();
+
+        // The same as Flush, but what's still in the encoders is left out, for a job that's been cancelled
+        int Close();
+
+        // Video frames the muxer has taken so far. After Flush or Close, the ones in the file.
+        int64_t GetMuxedVideoFrameCount() const { return muxedVideoFrames_.load(std::memory_order_relaxed); }
         int GetLastError() { return lastError_; }
+        FramePoolStats GetFramePoolStats() const { return framePool_.GetStats(); }
+        size_t GetMuxQueueHighWater() const { return muxQueue_.GetHighWater(); }
+
+        // Adds the bytes of each packet to progress as the mux thread writes it. Call it before writing anything.
+        void SetProgress(ProgressCounters *progress) { progress_ = progress; }
+
+        // The same as InputVideoFile's, for the video encoder. Call it before writing anything. libx264 never
+        // calls execute, it's only of use to libavcodec's own encoders.
+        bool SetThreadPool(ThreadPool& pool);
+        int64_t GetPoolExecuteCount() const { return videoCallbacks_.executeCalls; }
+
+        static const size_t DefaultIoBufferSize = 4 * 1024 * 1024;
+        static const size_t MuxQueueDepth = 256; // packets
 
     protected:
+        // Sends frame to the encoder and queues whatever packets come out, returning how many
+        int EncodeFrame(AVCodecContext *codec, AVStream *stream, AVFrame *frame, AVPacket *packet);
+        int QueuePacket(AVPacket *packet);
+        void MuxThreadEntry();
+        void StopMuxThread();
+        int WriteTrailer();
+        static int WriteFile(void *opaque, uint8_t *buffer, int size);
+        static int64_t SeekFile(void *opaque, int64_t offset, int whence);
+
         std::string filename_;
         std::ostream& outputStream_;
+        FramePool framePool_; // where frames for the video encoder come from
+        CodecCallbackData videoCallbacks_;
+        FILE *file_;
+        std::vector<AVPacket *> muxPackets_;
+        BoundedQueue<AVPacket *> freeMuxPackets_;
+        BoundedQueue<AVPacket *> muxQueue_; // encoded packets waiting to be written
+        std::thread muxThread_;
+        std::atomic<int> muxError_;
+        std::atomic<int64_t> muxedVideoFrames_;
+        ProgressCounters *progress_;
         AVFormatContext *formatContext_;
         AVCodecContext *videoCodecContext_;
         AVCodecContext *audioCodecContext_;
         AVStream *videoStream_;
         AVStream *audioStream_;
+        AVRational audioSourceTimeBase_; // what copied audio packets' timestamps are in
         SwrContext *audioResampleContext_;
+        AVPacket *packet_; // reused for every packet that comes out of the video encoder
+        AVPacket *audioPacket_; // and the audio one, which can be running on a different thread
+        AVFrame *conversionFrame_; // resampled audio, its buffers are kept for the next frame when they're free
+        int conversionSamples_; // how many samples conversionFrame_'s buffers have room for
         int videoFrameCount_;
         int audioFrameCount_;
         int lastError_;
+        bool trailerWritten_;
     };
 
     std::string GetErrorString(int errorCode);
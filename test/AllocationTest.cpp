@@ -0,0 +1,182 @@
+// Runs a short clip through Go and checks that once the job has warmed up, it stops allocating. The count is
+// whatever AllocationCounter sees, which is every C++ allocation but only the libav ones we ask for ourselves.
+
+extern "C"
+{
+    #include "libavcodec/avcodec.h"
+    #include "libavformat/avformat.h"
+    #include "libavutil/avutil.h"
+}
+
+#include "libderperview.hpp"
+#include "Pipeline.hpp"
+
+#include <streambuf>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+
+// 4:3, and long enough to get well past the pipeline's warm up
+static const int ClipWidth = 320;
+static const int ClipHeight = 240;
+static const int ClipFrames = static_cast<int>(DerperView::Pipeline::WarmupFrames) * 2;
+
+// Somewhere for the job to write to that's big enough from the start, so its output doesn't count
+class FixedBuffer : public streambuf
+{
+public:
+    FixedBuffer(size_t size) : text_(size)
+    {
+        setp(text_.data(), text_.data() + text_.size());
+    }
+
+    string GetText() const { return string(pbase(), pptr()); }
+
+protected:
+    vector<char> text_;
+};
+
+// MPEG-4 part 2, as libavcodec always has an encoder for it and its decoder draws bands
+static int WriteClip(const string& filename)
+{
+    AVFormatContext *format = nullptr;
+    int result = avformat_alloc_output_context2(&format, nullptr, nullptr, filename.c_str());
+    if (result < 0)
+        return result;
+
+    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+    AVCodecContext *context = codec != nullptr ? avcodec_alloc_context3(codec) : nullptr;
+    AVStream *stream = avformat_new_stream(format, nullptr);
+    AVFrame *frame = av_frame_alloc();
+    AVPacket *packet = av_packet_alloc();
+    if (context == nullptr || stream == nullptr || frame == nullptr || packet == nullptr)
+        result = AVERROR(ENOMEM);
+
+    if (result >= 0)
+    {
+        context->width = ClipWidth;
+        context->height = ClipHeight;
+        context->pix_fmt = AV_PIX_FMT_YUV420P;
+        context->time_base = AVRational { 1, 30 };
+        context->framerate = AVRational { 30, 1 };
+        context->gop_size = 30;
+        if (format->oformat->flags & AVFMT_GLOBALHEADER)
+            context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        result = avcodec_open2(context, codec, nullptr);
+    }
+    if (result >= 0)
+        result = avcodec_parameters_from_context(stream->codecpar, context);
+    if (result >= 0)
+    {
+        stream->time_base = context->time_base;
+        result = avio_open(&format->pb, filename.c_str(), AVIO_FLAG_WRITE);
+    }
+    if (result >= 0)
+        result = avformat_write_header(format, nullptr);
+
+    if (result >= 0)
+    {
+        frame->format = context->pix_fmt;
+        frame->width = context->width;
+        frame->height = context->height;
+        result = av_frame_get_buffer(frame, 0);
+    }
+
+    // A gradient that moves along, so there's something to encode. The last time round flushes the encoder.
+    for (int i = 0; i <= ClipFrames && result >= 0; i++)
+    {
+        AVFrame *sending = nullptr;
+        if (i < ClipFrames)
+        {
+            result = av_frame_make_writable(frame);
+            for (int y = 0; y < ClipHeight && result >= 0; y++)
+                for (int x = 0; x < ClipWidth; x++)
+                    frame->data[0][y * frame->linesize[0] + x] = static_cast<uint8_t>(x + y + i * 3);
+            for (int plane = 1; plane < 3 && result >= 0; plane++)
+                for (int y = 0; y < ClipHeight / 2; y++)
+                    for (int x = 0; x < ClipWidth / 2; x++)
+                        frame->data[plane][y * frame->linesize[plane] + x] = static_cast<uint8_t>(plane * 64 + x - i);
+            frame->pts = i;
+            sending = frame;
+        }
+        if (result >= 0)
+            result = avcodec_send_frame(context, sending);
+
+        while (result >= 0)
+        {
+            result = avcodec_receive_packet(context, packet);
+            if (result == AVERROR(EAGAIN) || result == AVERROR_EOF)
+            {
+                result = 0;
+                break;
+            }
+            if (result < 0)
+                break;
+            av_packet_rescale_ts(packet, context->time_base, stream->time_base);
+            packet->stream_index = stream->index;
+            result = av_interleaved_write_frame(format, packet);
+        }
+    }
+    if (result >= 0)
+        result = av_write_trailer(format);
+
+    av_packet_free(&packet);
+    av_frame_free(&frame);
+    avcodec_free_context(&context);
+    if (format->pb != nullptr)
+        avio_closep(&format->pb);
+    avformat_free_context(format);
+    return result;
+}
+
+int main()
+{
+    av_log_set_level(AV_LOG_ERROR);
+
+    const string inputFilename = "allocation-test.mp4";
+    const string outputFilename = "allocation-test.out.mp4";
+    int result = WriteClip(inputFilename);
+    if (result < 0)
+    {
+        cerr << "Could not write the test clip: " << result << endl;
+        return 1;
+    }
+
+    DerperView::Settings settings;
+    settings.threads = 4;
+    settings.noAudio = true;
+    FixedBuffer buffer(1024 * 1024);
+    ostream outputStream(&buffer);
+    result = Go(inputFilename, outputFilename, settings, outputStream);
+
+    string text = buffer.GetText();
+    cout << text;
+    remove(inputFilename.c_str());
+    remove(outputFilename.c_str());
+    if (result != 0)
+    {
+        cerr << "Go failed with " << result << endl;
+        return 1;
+    }
+
+    const string label = "Allocations after warm up: ";
+    size_t found = text.find(label);
+    if (found == string::npos)
+    {
+        cerr << "Go didn't say how many allocations there were after warm up" << endl;
+        return 1;
+    }
+    long long allocations = atoll(text.c_str() + found + label.size());
+    if (allocations != 0)
+    {
+        cerr << allocations << " allocations after warm up, there should be none" << endl;
+        return 1;
+    }
+
+    cout << "No allocations after warm up" << endl;
+    return 0;
+}
@@ -0,0 +1,55 @@
+// Checks the tuner moves the stretch's thread count both ways within the pool: up when stretching is what's
+// keeping the encoder waiting, and back down once it isn't.
+
+#include "ThreadPool.hpp"
+#include "ThreadTuner.hpp"
+
+#include <chrono>
+#include <iostream>
+
+using namespace DerperView;
+using namespace std;
+
+// One adjustment's worth of frames, with each stretch taking stretchTime and each encode encodeTime
+static void RunInterval(ThreadTuner& tuner, chrono::milliseconds stretchTime, chrono::milliseconds encodeTime)
+{
+    for (int64_t i = 0; i < ThreadTuner::AdjustInterval; i++)
+    {
+        tuner.StretchFinished(stretchTime);
+        tuner.FrameEncoded(encodeTime);
+    }
+}
+
+static bool Expect(const char *what, unsigned int actual, unsigned int expected)
+{
+    if (actual == expected)
+        return true;
+    cerr << what << " is " << actual << ", should be " << expected << endl;
+    return false;
+}
+
+int main()
+{
+    ThreadPool pool(8);
+    ThreadTuner tuner(pool, 2);
+    bool passed = Expect("starting thread count", pool.GetActiveThreadCount(), 2);
+
+    // Stretches taking four times as long as encodes want 4 * 1.5 threads
+    RunInterval(tuner, chrono::milliseconds(40), chrono::milliseconds(10));
+    passed &= Expect("thread count with slow stretches", tuner.GetThreads(), 6);
+    passed &= Expect("pool's thread count with slow stretches", pool.GetActiveThreadCount(), 6);
+
+    // Never more than the pool has
+    RunInterval(tuner, chrono::milliseconds(100), chrono::milliseconds(10));
+    passed &= Expect("thread count with very slow stretches", tuner.GetThreads(), 8);
+
+    // And back down once the encoder is the slow one
+    RunInterval(tuner, chrono::milliseconds(10), chrono::milliseconds(40));
+    passed &= Expect("thread count with slow encodes", tuner.GetThreads(), 1);
+    passed &= Expect("adjustment count", tuner.GetAdjustmentCount(), 3);
+
+    if (!passed)
+        return 1;
+    cout << "The tuner went up and back down" << endl;
+    return 0;
+}